@@ -0,0 +1,134 @@
+#include "components.h"
+
+#include <assert.h>
+
+static uint32_t findRoot(std::vector<uint32_t>& parent, uint32_t run) {
+  while(parent[run] != run) {
+    // Path halving keeps the trees shallow without a second walk.
+    parent[run] = parent[parent[run]];
+    run = parent[run];
+  }
+  return run;
+}
+
+static void unite(std::vector<uint32_t>& parent, uint32_t a, uint32_t b) {
+  a = findRoot(parent, a);
+  b = findRoot(parent, b);
+  // The earlier run becomes the root so numbering follows raster order.
+  if(a < b) {
+    parent[b] = a;
+  } else if(b < a) {
+    parent[a] = b;
+  }
+}
+
+void labelComponents(const FeatureMap& featureBuffer, ComponentMap& componentMap) {
+  std::vector<struct FeatureRun>& runs = componentMap.runs;
+  std::vector<uint32_t>& parent = componentMap.parent;
+  runs.clear();
+  parent.clear();
+  componentMap.components.clear();
+  assert(featureBuffer.width <= 0xffff && featureBuffer.height <= 0xffff);
+
+  size_t previousBegin = 0;
+  size_t previousEnd = 0;
+  for(unsigned int y = 0; y < featureBuffer.height; y++) {
+    const uint64_t* words = featureBuffer.row(y);
+    const size_t rowBegin = runs.size();
+
+    // Find runs a word at a time: ctz of the bits finds where a run starts
+    // and ctz of the inverted bits where it stops.
+    bool open = false;
+    unsigned int start = 0;
+    for(size_t word = 0; word < featureBuffer.wordsPerRow; word++) {
+      const uint64_t bits = words[word];
+      unsigned int position = 0;
+      while(position < 64) {
+        const uint64_t rest = (open ? ~bits : bits) >> position;
+        if(!rest) {
+          break;
+        }
+        position += __builtin_ctzll(rest);
+        if(open) {
+          runs.push_back({(uint16_t)y, (uint16_t)start, (uint16_t)(word * 64 + position), 0});
+        } else {
+          start = word * 64 + position;
+        }
+        open = !open;
+      }
+    }
+    if(open) {
+      runs.push_back({(uint16_t)y, (uint16_t)start, (uint16_t)featureBuffer.width, 0});
+    }
+
+    // Union with the runs above that touch, diagonals included. Both rows
+    // are sorted so one sweep finds every overlap.
+    size_t above = previousBegin;
+    for(size_t run = rowBegin; run < runs.size(); run++) {
+      parent.push_back(run);
+      while(above < previousEnd && runs[above].end < runs[run].start) {
+        above++;
+      }
+      for(size_t candidate = above;
+          candidate < previousEnd && runs[candidate].start <= runs[run].end;
+          candidate++) {
+        unite(parent, run, candidate);
+      }
+    }
+    previousBegin = rowBegin;
+    previousEnd = runs.size();
+  }
+
+  // Second scan. Roots always come before the runs under them, so the
+  // component index of a root is known by the time it is needed.
+  for(size_t run = 0; run < runs.size(); run++) {
+    const uint32_t root = findRoot(parent, run);
+    FeatureRun& current = runs[run];
+    if(root == run) {
+      current.component = componentMap.components.size();
+      componentMap.components.push_back(
+          {0, current.start, current.y, current.start, current.y, 0, 0});
+    } else {
+      current.component = runs[root].component;
+    }
+
+    Component& component = componentMap.components[current.component];
+    const uint32_t length = current.end - current.start;
+    component.area += length;
+    component.left = std::min(component.left, current.start);
+    component.right = std::max(component.right, (uint16_t)(current.end - 1));
+    component.bottom = current.y;
+    component.sumX += (uint64_t)(current.start + current.end - 1) * length / 2;
+    component.sumY += (uint64_t)current.y * length;
+  }
+}
+
+void filterComponents(FeatureMap& featureBuffer,
+                      ComponentMap& componentMap,
+                      const unsigned int minArea) {
+  std::vector<uint32_t>& renumber = componentMap.parent;
+  renumber.assign(componentMap.components.size(), 0);
+
+  size_t kept = 0;
+  for(size_t index = 0; index < componentMap.components.size(); index++) {
+    if(componentMap.components[index].area >= minArea) {
+      renumber[index] = kept;
+      componentMap.components[kept++] = componentMap.components[index];
+    } else {
+      renumber[index] = UINT32_MAX;
+    }
+  }
+  componentMap.components.resize(kept);
+
+  size_t keptRuns = 0;
+  for(const FeatureRun& run : componentMap.runs) {
+    if(renumber[run.component] == UINT32_MAX) {
+      featureBuffer.resetRange(run.start, run.end, run.y);
+    } else {
+      FeatureRun& moved = componentMap.runs[keptRuns++];
+      moved = run;
+      moved.component = renumber[run.component];
+    }
+  }
+  componentMap.runs.resize(keptRuns);
+}
@@ -0,0 +1,57 @@
+#ifndef WAZAT_COMPONENTS_H
+#define WAZAT_COMPONENTS_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "featuremap.h"
+
+/* A horizontal run of set pixels, columns [start, end) of row y. */
+struct FeatureRun {
+  uint16_t y;
+  uint16_t start;
+  uint16_t end;
+  uint32_t component;  // Index into ComponentMap::components.
+};
+
+/* One 8-connected group of feature pixels. Bounds are inclusive. */
+struct Component {
+  uint32_t area;
+  uint16_t left;
+  uint16_t top;
+  uint16_t right;
+  uint16_t bottom;
+  uint64_t sumX;
+  uint64_t sumY;
+
+  double centroidX() const {
+    return (double)sumX / area;
+  }
+
+  double centroidY() const {
+    return (double)sumY / area;
+  }
+};
+
+/* Every run of a feature map in raster order, each tagged with its
+ * component. Components are numbered in the order their first pixel is met
+ * scanning rows top to bottom. */
+struct ComponentMap {
+  std::vector<struct FeatureRun> runs;
+  std::vector<struct Component> components;
+  std::vector<uint32_t> parent;  // Scratch for labelling and filtering.
+};
+
+/* Split featureBuffer into 8-connected components. One scan collects the
+ * runs of each row and unions them with the overlapping runs of the row
+ * above. A second scan over the runs resolves labels and gathers area,
+ * bounding box and centroid. Cost is linear in the number of runs. */
+void labelComponents(const FeatureMap& featureBuffer, ComponentMap& componentMap);
+
+/* Clear every component smaller than minArea pixels from featureBuffer and
+ * drop it from componentMap, renumbering what remains. */
+void filterComponents(FeatureMap& featureBuffer,
+                      ComponentMap& componentMap,
+                      const unsigned int minArea);
+
+#endif  // WAZAT_COMPONENTS_H
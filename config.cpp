@@ -3,10 +3,13 @@
 Config config = {};
 
 ConfigEntry* configArray[MENU_ITEMS] = {
+  &config.fileDecode,
   &config.blurGaussian,
   &config.getFeatures,
   &config.filterThin,
   &config.filterSmallFeatures,
-  &config.hough
+  &config.filterComponents,
+  &config.hough,
+  &config.lineTracker
 };
 
@@ -3,7 +3,7 @@
 
 #include <vector>
 
-#define MENU_ITEMS 5
+#define MENU_ITEMS 8
 
 
 struct ConfigEntryValue {
@@ -23,13 +23,30 @@ struct ConfigEntry {
 };
   
 struct Config {
+  // Still image input only. Decode at scale/8 of full size, then keep the
+  // region given as fractions of the scaled image.
+  ConfigEntry fileDecode =
+    {"fileDecode",
+      nullptr,
+      false,
+      {
+        {"scale", 4, 1, 1, 8},
+        {"roiLeft", 0, 0.05, 0, 0.95},
+        {"roiTop", 0, 0.05, 0, 0.95},
+        {"roiWidth", 1, 0.05, 0.05, 1},
+        {"roiHeight", 1, 0.05, 0.05, 1}
+      }
+    };
   ConfigEntry blurGaussian =
     {"blurGaussian",
       nullptr,
       false,
       {
         {"blurDepth", 3.0, 2.0, 3.0, 7.0},
-        {"blurSigma", 1.0, 0.2, 0.2, 3.0}
+        {"blurSigma", 1.0, 0.2, 0.2, 3.0},
+        // 0 for a true Gaussian, otherwise approximate it with this many box
+        // blurs, which cost the same whatever the sigma.
+        {"boxPasses", 0, 1, 0, 4}
       }
     };
   ConfigEntry getFeatures =
@@ -57,13 +74,73 @@ struct Config {
       false,
       { }
     };
+  // Drop connected groups of features covering fewer than minArea pixels.
+  ConfigEntry filterComponents =
+    {"filterComponents",
+      nullptr,
+      false,
+      {
+        {"minArea", 20, 5, 1, 1000}
+      }
+    };
+  // Voting modes, highest precedence first: probabilistic, then the
+  // lineTracker entry, then coarseFactor above 1, then decay above 0, then
+  // orientWindow above 0, otherwise the plain full transform. Settings of a
+  // mode that is overridden are ignored.
   ConfigEntry hough =
     {"hough",
       nullptr,
       false,
       { 
         {"threshold", 70, 10, 10, 500},
-        {"dilate count", 2, 1, 0, 20}
+        // Peaks must be the largest this many cells round in r and a.
+        {"neighbourhood", 2, 1, 1, 20},
+        // 0 for one per core. Threads give the same votes as one, but the
+        // speed up has not been measured on a multi-core machine. Leave at 1
+        // until a -DHOUGH_BENCH build there shows which count to use.
+        {"threads", 1, 1, 0, 16},
+        // 1 for the progressive probabilistic transform, which returns
+        // segments and votes with at most budget pixels.
+        {"probabilistic", 0, 1, 0, 1},
+        {"minLength", 30, 5, 5, 500},
+        {"maxGap", 5, 1, 0, 50},
+        {"maxLines", 50, 5, 1, 500},  // Peaks or segments kept.
+        {"budget", 20000, 1000, 1000, 200000},
+        // Above 0 each pixel of the full transform only votes this many
+        // degrees either side of its edge normal. Edge orientation is only
+        // worked out in this mode.
+        {"orientWindow", 0, 1, 0, 45},
+        // Peaks this close in both r and a to a stronger one are dropped.
+        {"mergeDistance", 4, 1, 0, 30},
+        // Accumulator cell size in degrees and pixels.
+        {"angleStep", 1, 0.25, 0.25, 10},
+        {"rStep", 1, 1, 1, 10},
+        // Above 1, find peaks on cells this many times larger first and
+        // only vote at full resolution round them.
+        {"coarseFactor", 0, 1, 0, 8},
+        // 1 to follow each peak through the features and show segments of
+        // at least minLength, bridging maxGap, instead of whole lines.
+        {"segments", 1, 1, 0, 1},
+        // Above 0 the full transform keeps its accumulator from frame to
+        // frame, scaled by decay, and only one in voteStride pixels votes
+        // each frame. Keep voteStride * (1 - decay) near 1 for threshold to
+        // mean the same.
+        {"decay", 0, 0.05, 0, 0.95},
+        {"voteStride", 4, 1, 1, 16}
+      }
+    };
+  // Follow the lines of the full Hough transform from frame to frame and
+  // only vote round where they are expected, with a full transform every
+  // cadence frames or when one is lost.
+  ConfigEntry lineTracker =
+    {"lineTracker",
+      nullptr,
+      false,
+      {
+        {"cadence", 10, 1, 1, 100},
+        {"angleReach", 3, 1, 1, 30},
+        {"rReach", 8, 1, 1, 50},
+        {"maxMissed", 2, 1, 0, 10}
       }
     };
 };
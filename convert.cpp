@@ -0,0 +1,290 @@
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WAZAT_X86
+#endif
+
+/* BT.601 limited range in 6 bit fixed point:
+ *   R = (74 * (Y - 16)                  + 102 * (V - 128) + 32) >> 6
+ *   G = (74 * (Y - 16) -  25 * (U - 128) -  52 * (V - 128) + 32) >> 6
+ *   B = (74 * (Y - 16) + 129 * (U - 128)                  + 32) >> 6
+ * Every intermediate fits in 16 bits except the blue sum, which can only
+ * overflow when the result would clip to 255 anyway. So the saturating SIMD
+ * paths give exactly the same output as the scalar one. */
+
+static inline uint8_t clip(const int value) {
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static void yuyvRowToRgbScalar(const uint8_t* src,
+                               uint8_t* rgb,
+                               const unsigned int start,
+                               const unsigned int width) {
+  for(unsigned int x = start; x < width; x += 2) {
+    const int y0 = 74 * (src[2 * x + 0] - 16) + 32;
+    const int u = src[2 * x + 1] - 128;
+    const int y1 = 74 * (src[2 * x + 2] - 16) + 32;
+    const int v = src[2 * x + 3] - 128;
+
+    const int r = 102 * v;
+    const int g = -25 * u - 52 * v;
+    const int b = 129 * u;
+
+    rgb[3 * x + 0] = clip((y0 + r) >> 6);
+    rgb[3 * x + 1] = clip((y0 + g) >> 6);
+    rgb[3 * x + 2] = clip((y0 + b) >> 6);
+    rgb[3 * x + 3] = clip((y1 + r) >> 6);
+    rgb[3 * x + 4] = clip((y1 + g) >> 6);
+    rgb[3 * x + 5] = clip((y1 + b) >> 6);
+  }
+}
+
+static void yuyvRowToLumaScalar(const uint8_t* src,
+                                uint8_t* luma,
+                                const unsigned int start,
+                                const unsigned int width) {
+  for(unsigned int x = start; x < width; x++) {
+    luma[x] = src[2 * x];
+  }
+}
+
+#ifdef WAZAT_X86
+
+/* Shuffles that turn [R0..R7 G0..G7] and [B0..B7 B0..B7] into 24 bytes of
+ * interleaved RGB: 16 bytes from the first pair, 8 from the second. */
+#define RGB_SHUFFLES \
+  const __m128i rgLo = _mm_setr_epi8( \
+      0, 8, -128, 1, 9, -128, 2, 10, -128, 3, 11, -128, 4, 12, -128, 5); \
+  const __m128i bLo = _mm_setr_epi8( \
+      -128, -128, 0, -128, -128, 1, -128, -128, 2, -128, -128, 3, -128, -128, 4, -128); \
+  const __m128i rgHi = _mm_setr_epi8( \
+      13, -128, 6, 14, -128, 7, 15, -128, -128, -128, -128, -128, -128, -128, -128, -128); \
+  const __m128i bHi = _mm_setr_epi8( \
+      -128, 5, -128, -128, 6, -128, -128, 7, -128, -128, -128, -128, -128, -128, -128, -128);
+
+__attribute__((target("ssse3")))
+static void yuyvRowToRgbSsse3(const uint8_t* src,
+                              uint8_t* rgb,
+                              const unsigned int start,
+                              const unsigned int width) {
+  RGB_SHUFFLES
+  const __m128i lowByte = _mm_set1_epi16(0x00ff);
+  const __m128i lowWord = _mm_set1_epi32(0x0000ffff);
+  const __m128i y16 = _mm_set1_epi16(16);
+  const __m128i uv128 = _mm_set1_epi16(128);
+  const __m128i round = _mm_set1_epi16(32);
+
+  unsigned int x = start;
+  for(; x + 8 <= width; x += 8) {
+    const __m128i in = _mm_loadu_si128((const __m128i*)(src + 2 * x));
+
+    // Y0 Y1 ... Y7 and U0 V0 U1 V1 ... as 16 bit lanes.
+    const __m128i y = _mm_sub_epi16(_mm_and_si128(in, lowByte), y16);
+    const __m128i uv = _mm_srli_epi16(in, 8);
+    // Give each pixel of a pair its shared U and V.
+    __m128i u = _mm_and_si128(uv, lowWord);
+    u = _mm_or_si128(u, _mm_slli_epi32(u, 16));
+    __m128i v = _mm_srli_epi32(uv, 16);
+    v = _mm_or_si128(v, _mm_slli_epi32(v, 16));
+    u = _mm_sub_epi16(u, uv128);
+    v = _mm_sub_epi16(v, uv128);
+
+    const __m128i yy = _mm_add_epi16(_mm_mullo_epi16(y, _mm_set1_epi16(74)), round);
+    const __m128i r = _mm_srai_epi16(
+        _mm_adds_epi16(yy, _mm_mullo_epi16(v, _mm_set1_epi16(102))), 6);
+    const __m128i g = _mm_srai_epi16(
+        _mm_sub_epi16(_mm_sub_epi16(yy, _mm_mullo_epi16(u, _mm_set1_epi16(25))),
+                      _mm_mullo_epi16(v, _mm_set1_epi16(52))), 6);
+    const __m128i b = _mm_srai_epi16(
+        _mm_adds_epi16(yy, _mm_mullo_epi16(u, _mm_set1_epi16(129))), 6);
+
+    const __m128i rg = _mm_packus_epi16(r, g);
+    const __m128i bb = _mm_packus_epi16(b, b);
+
+    _mm_storeu_si128((__m128i*)(rgb + 3 * x),
+        _mm_or_si128(_mm_shuffle_epi8(rg, rgLo), _mm_shuffle_epi8(bb, bLo)));
+    _mm_storel_epi64((__m128i*)(rgb + 3 * x + 16),
+        _mm_or_si128(_mm_shuffle_epi8(rg, rgHi), _mm_shuffle_epi8(bb, bHi)));
+  }
+  yuyvRowToRgbScalar(src, rgb, x, width);
+}
+
+__attribute__((target("avx2")))
+static void yuyvRowToRgbAvx2(const uint8_t* src,
+                             uint8_t* rgb,
+                             const unsigned int start,
+                             const unsigned int width) {
+  RGB_SHUFFLES
+  const __m256i rgLo2 = _mm256_broadcastsi128_si256(rgLo);
+  const __m256i bLo2 = _mm256_broadcastsi128_si256(bLo);
+  const __m256i rgHi2 = _mm256_broadcastsi128_si256(rgHi);
+  const __m256i bHi2 = _mm256_broadcastsi128_si256(bHi);
+  const __m256i lowByte = _mm256_set1_epi16(0x00ff);
+  const __m256i lowWord = _mm256_set1_epi32(0x0000ffff);
+  const __m256i y16 = _mm256_set1_epi16(16);
+  const __m256i uv128 = _mm256_set1_epi16(128);
+  const __m256i round = _mm256_set1_epi16(32);
+
+  unsigned int x = start;
+  for(; x + 16 <= width; x += 16) {
+    const __m256i in = _mm256_loadu_si256((const __m256i*)(src + 2 * x));
+
+    const __m256i y = _mm256_sub_epi16(_mm256_and_si256(in, lowByte), y16);
+    const __m256i uv = _mm256_srli_epi16(in, 8);
+    __m256i u = _mm256_and_si256(uv, lowWord);
+    u = _mm256_or_si256(u, _mm256_slli_epi32(u, 16));
+    __m256i v = _mm256_srli_epi32(uv, 16);
+    v = _mm256_or_si256(v, _mm256_slli_epi32(v, 16));
+    u = _mm256_sub_epi16(u, uv128);
+    v = _mm256_sub_epi16(v, uv128);
+
+    const __m256i yy = _mm256_add_epi16(
+        _mm256_mullo_epi16(y, _mm256_set1_epi16(74)), round);
+    const __m256i r = _mm256_srai_epi16(
+        _mm256_adds_epi16(yy, _mm256_mullo_epi16(v, _mm256_set1_epi16(102))), 6);
+    const __m256i g = _mm256_srai_epi16(
+        _mm256_sub_epi16(
+          _mm256_sub_epi16(yy, _mm256_mullo_epi16(u, _mm256_set1_epi16(25))),
+          _mm256_mullo_epi16(v, _mm256_set1_epi16(52))), 6);
+    const __m256i b = _mm256_srai_epi16(
+        _mm256_adds_epi16(yy, _mm256_mullo_epi16(u, _mm256_set1_epi16(129))), 6);
+
+    // Packing works within each 128 bit lane, so each lane holds 8 pixels
+    // laid out exactly as in the SSSE3 version.
+    const __m256i rg = _mm256_packus_epi16(r, g);
+    const __m256i bb = _mm256_packus_epi16(b, b);
+    const __m256i lo = _mm256_or_si256(_mm256_shuffle_epi8(rg, rgLo2),
+                                       _mm256_shuffle_epi8(bb, bLo2));
+    const __m256i hi = _mm256_or_si256(_mm256_shuffle_epi8(rg, rgHi2),
+                                       _mm256_shuffle_epi8(bb, bHi2));
+
+    _mm_storeu_si128((__m128i*)(rgb + 3 * x), _mm256_castsi256_si128(lo));
+    _mm_storel_epi64((__m128i*)(rgb + 3 * x + 16), _mm256_castsi256_si128(hi));
+    _mm_storeu_si128((__m128i*)(rgb + 3 * x + 24), _mm256_extracti128_si256(lo, 1));
+    _mm_storel_epi64((__m128i*)(rgb + 3 * x + 40), _mm256_extracti128_si256(hi, 1));
+  }
+  yuyvRowToRgbScalar(src, rgb, x, width);
+}
+
+__attribute__((target("sse2")))
+static void yuyvRowToLumaSse2(const uint8_t* src,
+                              uint8_t* luma,
+                              const unsigned int start,
+                              const unsigned int width) {
+  const __m128i lowByte = _mm_set1_epi16(0x00ff);
+  unsigned int x = start;
+  for(; x + 16 <= width; x += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i*)(src + 2 * x));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(src + 2 * x + 16));
+    _mm_storeu_si128((__m128i*)(luma + x),
+        _mm_packus_epi16(_mm_and_si128(a, lowByte), _mm_and_si128(b, lowByte)));
+  }
+  yuyvRowToLumaScalar(src, luma, x, width);
+}
+
+__attribute__((target("avx2")))
+static void yuyvRowToLumaAvx2(const uint8_t* src,
+                              uint8_t* luma,
+                              const unsigned int start,
+                              const unsigned int width) {
+  const __m256i lowByte = _mm256_set1_epi16(0x00ff);
+  unsigned int x = start;
+  for(; x + 32 <= width; x += 32) {
+    const __m256i a = _mm256_loadu_si256((const __m256i*)(src + 2 * x));
+    const __m256i b = _mm256_loadu_si256((const __m256i*)(src + 2 * x + 32));
+    const __m256i packed = _mm256_packus_epi16(_mm256_and_si256(a, lowByte),
+                                               _mm256_and_si256(b, lowByte));
+    // Undo the per lane interleave of the pack.
+    _mm256_storeu_si256((__m256i*)(luma + x),
+                        _mm256_permute4x64_epi64(packed, 0xd8));
+  }
+  yuyvRowToLumaScalar(src, luma, x, width);
+}
+
+#endif  // WAZAT_X86
+
+typedef void (*RowFunction)(const uint8_t*, uint8_t*, const unsigned int, const unsigned int);
+
+static RowFunction pickRgbRow() {
+#ifdef WAZAT_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    return yuyvRowToRgbAvx2;
+  }
+  if(__builtin_cpu_supports("ssse3")) {
+    return yuyvRowToRgbSsse3;
+  }
+#endif
+  return yuyvRowToRgbScalar;
+}
+
+static RowFunction pickLumaRow() {
+#ifdef WAZAT_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    return yuyvRowToLumaAvx2;
+  }
+  return yuyvRowToLumaSse2;
+#endif
+  return yuyvRowToLumaScalar;
+}
+
+void yuyvToRgb(const uint8_t* src,
+               const size_t srcStride,
+               uint8_t* rgb,
+               const unsigned int width,
+               const unsigned int height) {
+  static const RowFunction row = pickRgbRow();
+  for(unsigned int y = 0; y < height; y++) {
+    row(src + y * srcStride, rgb + y * width * 3, 0, width);
+  }
+}
+
+void yuyvToLuma(const uint8_t* src,
+                const size_t srcStride,
+                uint8_t* luma,
+                const unsigned int width,
+                const unsigned int height) {
+  static const RowFunction row = pickLumaRow();
+  for(unsigned int y = 0; y < height; y++) {
+    row(src + y * srcStride, luma + y * width, 0, width);
+  }
+}
+
+void planarYuvToRgb(const uint8_t* yPlane,
+                    const uint8_t* uPlane,
+                    const uint8_t* vPlane,
+                    uint8_t* rgb,
+                    const unsigned int width,
+                    const unsigned int height,
+                    const unsigned int chromaShiftX,
+                    const unsigned int chromaShiftY) {
+  const unsigned int chromaWidth = (width + (1 << chromaShiftX) - 1) >> chromaShiftX;
+
+  for(unsigned int y = 0; y < height; y++) {
+    const uint8_t* yRow = yPlane + y * width;
+    uint8_t* out = rgb + y * width * 3;
+
+    if(uPlane == nullptr || vPlane == nullptr) {
+      for(unsigned int x = 0; x < width; x++) {
+        const uint8_t grey = clip((74 * (yRow[x] - 16) + 32) >> 6);
+        out[3 * x + 0] = grey;
+        out[3 * x + 1] = grey;
+        out[3 * x + 2] = grey;
+      }
+      continue;
+    }
+
+    const uint8_t* uRow = uPlane + (y >> chromaShiftY) * chromaWidth;
+    const uint8_t* vRow = vPlane + (y >> chromaShiftY) * chromaWidth;
+    for(unsigned int x = 0; x < width; x++) {
+      const int yy = 74 * (yRow[x] - 16) + 32;
+      const int u = uRow[x >> chromaShiftX] - 128;
+      const int v = vRow[x >> chromaShiftX] - 128;
+      out[3 * x + 0] = clip((yy + 102 * v) >> 6);
+      out[3 * x + 1] = clip((yy - 25 * u - 52 * v) >> 6);
+      out[3 * x + 2] = clip((yy + 129 * u) >> 6);
+    }
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef WAZAT_CONVERT_H
+#define WAZAT_CONVERT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Convert packed YUYV (YUV 4:2:2, BT.601 limited range) to interleaved RGB24.
+ * srcStride is the length of a source row in bytes; the RGB output is packed
+ * at width * 3 bytes per row. width must be even. */
+void yuyvToRgb(const uint8_t* src,
+               const size_t srcStride,
+               uint8_t* rgb,
+               const unsigned int width,
+               const unsigned int height);
+
+/* Copy just the luma plane out of packed YUYV. The output is packed at width
+ * bytes per row. Cheaper than yuyvToRgb() for stages that only need
+ * intensity. */
+void yuyvToLuma(const uint8_t* src,
+                const size_t srcStride,
+                uint8_t* luma,
+                const unsigned int width,
+                const unsigned int height);
+
+/* Convert planar YUV (BT.601 limited range) to interleaved RGB24. The chroma
+ * planes are subsampled by 1 << chromaShiftX horizontally and
+ * 1 << chromaShiftY vertically, so 4:2:0 is (1, 1), 4:2:2 is (1, 0) and
+ * 4:4:4 is (0, 0). Pass null chroma planes for greyscale. */
+void planarYuvToRgb(const uint8_t* yPlane,
+                    const uint8_t* uPlane,
+                    const uint8_t* vPlane,
+                    uint8_t* rgb,
+                    const unsigned int width,
+                    const unsigned int height,
+                    const unsigned int chromaShiftX,
+                    const unsigned int chromaShiftY);
+
+#endif  // WAZAT_CONVERT_H
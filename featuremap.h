@@ -0,0 +1,169 @@
+#ifndef WAZAT_FEATUREMAP_H
+#define WAZAT_FEATUREMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+
+/* One bit per pixel marking which pixels are features. Pixel (x, y) is bit
+ * x & 63 of word x >> 6 of row y. Rows are padded to whole words and the
+ * padding bits are always clear, so whole words can be tested, counted and
+ * skipped without edge cases. */
+class FeatureMap {
+ public:
+  unsigned int width = 0;
+  unsigned int height = 0;
+  size_t wordsPerRow = 0;
+  std::vector<uint64_t> words;
+
+  /* Set the size and clear every pixel. */
+  void resize(const unsigned int width_, const unsigned int height_) {
+    width = width_;
+    height = height_;
+    wordsPerRow = (width + 63) / 64;
+    words.assign(wordsPerRow * height, 0);
+  }
+
+  void clear() {
+    std::fill(words.begin(), words.end(), 0);
+  }
+
+  uint64_t* row(const unsigned int y) {
+    return words.data() + y * wordsPerRow;
+  }
+
+  const uint64_t* row(const unsigned int y) const {
+    return words.data() + y * wordsPerRow;
+  }
+
+  bool get(const unsigned int x, const unsigned int y) const {
+    return (row(y)[x >> 6] >> (x & 63)) & 1;
+  }
+
+  void set(const unsigned int x, const unsigned int y) {
+    row(y)[x >> 6] |= 1ull << (x & 63);
+  }
+
+  void reset(const unsigned int x, const unsigned int y) {
+    row(y)[x >> 6] &= ~(1ull << (x & 63));
+  }
+
+  /* OR the low count bits of bits into row y from column x on. */
+  void setBits(const unsigned int x, const unsigned int y,
+               const uint64_t bits, const unsigned int count) {
+    uint64_t* words_ = row(y) + (x >> 6);
+    const unsigned int shift = x & 63;
+    words_[0] |= bits << shift;
+    if(shift + count > 64) {
+      words_[1] |= bits >> (64 - shift);
+    }
+  }
+
+  /* Clear columns [x0, x1) of row y. */
+  void resetRange(const unsigned int x0, const unsigned int x1, const unsigned int y) {
+    if(x0 >= x1) {
+      return;
+    }
+    uint64_t* words_ = row(y);
+    const size_t first = x0 >> 6;
+    const size_t last = (x1 - 1) >> 6;
+    const uint64_t firstMask = ~0ull << (x0 & 63);
+    const uint64_t lastMask = ~0ull >> (63 - ((x1 - 1) & 63));
+    if(first == last) {
+      words_[first] &= ~(firstMask & lastMask);
+      return;
+    }
+    words_[first] &= ~firstMask;
+    for(size_t word = first + 1; word < last; word++) {
+      words_[word] = 0;
+    }
+    words_[last] &= ~lastMask;
+  }
+
+  /* The 64 pixels of row y starting at column x, which may be -1. Columns
+   * outside the image read as clear. */
+  uint64_t bitsFrom(const int x, const unsigned int y) const {
+    if(x < 0) {
+      return bitsFrom(0, y) << -x;
+    }
+    const uint64_t* words_ = row(y);
+    const size_t word = x >> 6;
+    const unsigned int shift = x & 63;
+    if(word >= wordsPerRow) {
+      return 0;
+    }
+    uint64_t bits = words_[word] >> shift;
+    if(shift && word + 1 < wordsPerRow) {
+      bits |= words_[word + 1] << (64 - shift);
+    }
+    return bits;
+  }
+
+  /* The 8 neighbours of (x, y) packed clockwise from north: bit 0 is
+   * (x, y - 1), bit 1 (x + 1, y - 1), bit 2 (x + 1, y) through to bit 7,
+   * (x - 1, y - 1). Pixels outside the image read as clear. */
+  unsigned int neighbours(const unsigned int x, const unsigned int y) const {
+    const unsigned int above = y > 0 ? bitsFrom((int)x - 1, y - 1) & 7 : 0;
+    const unsigned int level = bitsFrom((int)x - 1, y) & 7;
+    const unsigned int below = y + 1 < height ? bitsFrom((int)x - 1, y + 1) & 7 : 0;
+    // above, level and below hold columns x - 1, x and x + 1 in bits 0 to 2.
+    return ((above >> 1) & 1) |        // N
+           ((above >> 2) & 1) << 1 |   // NE
+           ((level >> 2) & 1) << 2 |   // E
+           ((below >> 2) & 1) << 3 |   // SE
+           ((below >> 1) & 1) << 4 |   // S
+           (below & 1) << 5 |          // SW
+           (level & 1) << 6 |          // W
+           (above & 1) << 7;           // NW
+  }
+
+  size_t count() const {
+    size_t total = 0;
+    for(const uint64_t word : words) {
+      total += __builtin_popcountll(word);
+    }
+    return total;
+  }
+
+  /* Call visit(x, y) for every set pixel with x0 <= x < x1 and y0 <= y < y1,
+   * in row-major order. Empty words cost one test each. The current word is
+   * read before visiting its pixels, so visit may clear the pixel it is
+   * given. */
+  template <class Visit>
+  void forEachSet(const unsigned int x0, const unsigned int y0,
+                  unsigned int x1, const unsigned int y1,
+                  Visit visit) const {
+    x1 = std::min(x1, width);
+    if(x0 >= x1) {
+      return;
+    }
+    const size_t firstWord = x0 >> 6;
+    const size_t lastWord = (x1 - 1) >> 6;
+    const uint64_t firstMask = ~0ull << (x0 & 63);
+    const uint64_t lastMask = ~0ull >> (63 - ((x1 - 1) & 63));
+    for(unsigned int y = y0; y < y1 && y < height; y++) {
+      const uint64_t* words_ = row(y);
+      for(size_t word = firstWord; word <= lastWord; word++) {
+        uint64_t bits = words_[word];
+        if(word == firstWord) {
+          bits &= firstMask;
+        }
+        if(word == lastWord) {
+          bits &= lastMask;
+        }
+        while(bits) {
+          visit((unsigned int)(word * 64 + __builtin_ctzll(bits)), y);
+          bits &= bits - 1;
+        }
+      }
+    }
+  }
+
+  template <class Visit>
+  void forEachSet(Visit visit) const {
+    forEachSet(0, 0, width, height, visit);
+  }
+};
+
+#endif  // WAZAT_FEATUREMAP_H
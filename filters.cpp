@@ -1,34 +1,243 @@
 #include "filters.h"
-
-typedef std::vector<double> Array;
-typedef std::vector<Array> Matrix;
-
-Matrix getGaussian(const int size, const double sigma) {
-  //std::cout << "getGaussian" << std::endl;
+#include "integral.h"
+#include "hough.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WAZAT_X86
+#endif
+
+/* The blur is separable so it runs as a horizontal pass then a vertical one.
+ * Weights are Q14 and always sum to exactly 1 << 14. The horizontal pass
+ * keeps 6 fractional bits (Q6) in a 16 bit intermediate so rounding only
+ * happens once per pass:
+ *   h = (sum(w * pixel) + (1 << 7)) >> 8          0 <= h <= 255 << 6
+ *   out = (sum(w * h) + (1 << 19)) >> 20          0 <= out <= 255
+ * Both sums fit in 32 bits and both operands of every product fit in a
+ * signed 16 bit lane, so the SIMD paths multiply-add pairs of taps with
+ * pmaddwd and give exactly the same result as the scalar one. */
+#define BLUR_WEIGHT_BITS 14
+#define BLUR_FRACTION_BITS 6
+#define BLUR_MAX_KERNEL 31
+#define BOX_MAX_RADIUS 31
+
+/* 1D Gaussian of odd length size quantised to Q14. Rounding error is put on
+ * the centre tap so the weights still sum to exactly one. */
+static std::vector<int16_t> getGaussian(const int size, const double sigma) {
   assert(size % 2);  // Must be odd number.
   const int radius = (size - 1) / 2;
-  Matrix kernel(size, Array(size));
+  std::vector<double> kernel(size);
   double sum = 0.0;
-  int i, j;
 
-  for (i = -radius; i <= radius; i++) {
-    for (j = -radius; j <= radius; j++) {
-      kernel[i + radius][j + radius] =
-        exp(-(i*i + j*j) / (2*sigma*sigma)) / (2*M_PI * sigma*sigma);
-      sum += kernel[i + radius][j + radius];
+  for(int i = -radius; i <= radius; i++) {
+    kernel[i + radius] = exp(-(i * i) / (2 * sigma * sigma));
+    sum += kernel[i + radius];
+  }
+
+  std::vector<int16_t> weights(size);
+  int total = 0;
+  for(int i = 0; i < size; i++) {
+    weights[i] = lround(kernel[i] / sum * (1 << BLUR_WEIGHT_BITS));
+    total += weights[i];
+  }
+  weights[radius] += (1 << BLUR_WEIGHT_BITS) - total;
+
+  return weights;
+}
+
+/* One row of the horizontal pass. padded holds the row with radius pixels
+ * replicated onto each end, so the taps for element i sit at
+ * padded[i + 3 * k]. */
+static void blurRowScalar(const uint8_t* padded,
+                          uint16_t* out,
+                          const int16_t* weights,
+                          const int size,
+                          const unsigned int start,
+                          const unsigned int count) {
+  for(unsigned int i = start; i < count; i++) {
+    int sum = 1 << (BLUR_WEIGHT_BITS - BLUR_FRACTION_BITS - 1);
+    for(int k = 0; k < size; k++) {
+      sum += weights[k] * padded[i + 3 * k];
+    }
+    out[i] = sum >> (BLUR_WEIGHT_BITS - BLUR_FRACTION_BITS);
+  }
+}
+
+/* One row of the vertical pass. rows[k] is the horizontal pass output for
+ * tap k. */
+static void blurColumnScalar(const uint16_t* const* rows,
+                             uint8_t* out,
+                             const int16_t* weights,
+                             const int size,
+                             const unsigned int start,
+                             const unsigned int count) {
+  for(unsigned int i = start; i < count; i++) {
+    int sum = 1 << (BLUR_WEIGHT_BITS + BLUR_FRACTION_BITS - 1);
+    for(int k = 0; k < size; k++) {
+      sum += weights[k] * rows[k][i];
     }
+    out[i] = sum >> (BLUR_WEIGHT_BITS + BLUR_FRACTION_BITS);
   }
+}
+
+#ifdef WAZAT_X86
 
-  //std::cout << std::endl;
-  for (i = -radius; i <= radius; i++) {
-    for (j = -radius; j <= radius; j++) {
-      kernel[i + radius][j + radius] /= sum;
-      //std::cout << std::setw(15)<< kernel[i + radius][j + radius];
+/* Two adjacent weights packed as the 16 bit pair pmaddwd expects. A missing
+ * second tap gets a weight of zero. */
+static inline int weightPair(const int16_t* weights, const int k, const int size) {
+  const uint16_t low = weights[k];
+  const uint16_t high = k + 1 < size ? weights[k + 1] : 0;
+  return (int)((uint32_t)high << 16 | low);
+}
+
+__attribute__((target("sse2")))
+static void blurRowSse2(const uint8_t* padded,
+                        uint16_t* out,
+                        const int16_t* weights,
+                        const int size,
+                        const unsigned int start,
+                        const unsigned int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(1 << (BLUR_WEIGHT_BITS - BLUR_FRACTION_BITS - 1));
+  unsigned int i = start;
+  for(; i + 8 <= count; i += 8) {
+    __m128i low = round;
+    __m128i high = round;
+    for(int k = 0; k < size; k += 2) {
+      const __m128i w = _mm_set1_epi32(weightPair(weights, k, size));
+      const __m128i a = _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i*)(padded + i + 3 * k)), zero);
+      const __m128i b = k + 1 < size ? _mm_unpacklo_epi8(
+          _mm_loadl_epi64((const __m128i*)(padded + i + 3 * k + 3)), zero) : zero;
+      low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+      high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
     }
-    //std::cout << std::endl;
+    low = _mm_srai_epi32(low, BLUR_WEIGHT_BITS - BLUR_FRACTION_BITS);
+    high = _mm_srai_epi32(high, BLUR_WEIGHT_BITS - BLUR_FRACTION_BITS);
+    _mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(low, high));
   }
+  blurRowScalar(padded, out, weights, size, i, count);
+}
 
-  return kernel;
+__attribute__((target("sse2")))
+static void blurColumnSse2(const uint16_t* const* rows,
+                           uint8_t* out,
+                           const int16_t* weights,
+                           const int size,
+                           const unsigned int start,
+                           const unsigned int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(1 << (BLUR_WEIGHT_BITS + BLUR_FRACTION_BITS - 1));
+  unsigned int i = start;
+  for(; i + 8 <= count; i += 8) {
+    __m128i low = round;
+    __m128i high = round;
+    for(int k = 0; k < size; k += 2) {
+      const __m128i w = _mm_set1_epi32(weightPair(weights, k, size));
+      const __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+      const __m128i b = k + 1 < size ?
+        _mm_loadu_si128((const __m128i*)(rows[k + 1] + i)) : zero;
+      low = _mm_add_epi32(low, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+      high = _mm_add_epi32(high, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+    }
+    low = _mm_srai_epi32(low, BLUR_WEIGHT_BITS + BLUR_FRACTION_BITS);
+    high = _mm_srai_epi32(high, BLUR_WEIGHT_BITS + BLUR_FRACTION_BITS);
+    const __m128i words = _mm_packs_epi32(low, high);
+    _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(words, words));
+  }
+  blurColumnScalar(rows, out, weights, size, i, count);
+}
+
+/* The unpacks and packs below both work within 128 bit lanes, so the lane
+ * shuffles cancel and the words come out in order. */
+__attribute__((target("avx2")))
+static void blurRowAvx2(const uint8_t* padded,
+                        uint16_t* out,
+                        const int16_t* weights,
+                        const int size,
+                        const unsigned int start,
+                        const unsigned int count) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i round = _mm256_set1_epi32(1 << (BLUR_WEIGHT_BITS - BLUR_FRACTION_BITS - 1));
+  unsigned int i = start;
+  for(; i + 16 <= count; i += 16) {
+    __m256i low = round;
+    __m256i high = round;
+    for(int k = 0; k < size; k += 2) {
+      const __m256i w = _mm256_set1_epi32(weightPair(weights, k, size));
+      const __m256i a = _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i*)(padded + i + 3 * k)));
+      const __m256i b = k + 1 < size ? _mm256_cvtepu8_epi16(
+          _mm_loadu_si128((const __m128i*)(padded + i + 3 * k + 3))) : zero;
+      low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+      high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+    }
+    low = _mm256_srai_epi32(low, BLUR_WEIGHT_BITS - BLUR_FRACTION_BITS);
+    high = _mm256_srai_epi32(high, BLUR_WEIGHT_BITS - BLUR_FRACTION_BITS);
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_packs_epi32(low, high));
+  }
+  blurRowSse2(padded, out, weights, size, i, count);
+}
+
+__attribute__((target("avx2")))
+static void blurColumnAvx2(const uint16_t* const* rows,
+                           uint8_t* out,
+                           const int16_t* weights,
+                           const int size,
+                           const unsigned int start,
+                           const unsigned int count) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i round = _mm256_set1_epi32(1 << (BLUR_WEIGHT_BITS + BLUR_FRACTION_BITS - 1));
+  unsigned int i = start;
+  for(; i + 16 <= count; i += 16) {
+    __m256i low = round;
+    __m256i high = round;
+    for(int k = 0; k < size; k += 2) {
+      const __m256i w = _mm256_set1_epi32(weightPair(weights, k, size));
+      const __m256i a = _mm256_loadu_si256((const __m256i*)(rows[k] + i));
+      const __m256i b = k + 1 < size ?
+        _mm256_loadu_si256((const __m256i*)(rows[k + 1] + i)) : zero;
+      low = _mm256_add_epi32(low, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+      high = _mm256_add_epi32(high, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+    }
+    low = _mm256_srai_epi32(low, BLUR_WEIGHT_BITS + BLUR_FRACTION_BITS);
+    high = _mm256_srai_epi32(high, BLUR_WEIGHT_BITS + BLUR_FRACTION_BITS);
+    const __m256i words = _mm256_packs_epi32(low, high);
+    const __m256i bytes = _mm256_packus_epi16(words, words);
+    // Each lane holds 8 results in its low half. Gather them together.
+    _mm_storeu_si128((__m128i*)(out + i),
+        _mm256_castsi256_si128(_mm256_permute4x64_epi64(bytes, 0xd8)));
+  }
+  blurColumnSse2(rows, out, weights, size, i, count);
+}
+
+#endif  // WAZAT_X86
+
+typedef void (*BlurRowFunction)(const uint8_t*, uint16_t*, const int16_t*,
+                                const int, const unsigned int, const unsigned int);
+typedef void (*BlurColumnFunction)(const uint16_t* const*, uint8_t*, const int16_t*,
+                                   const int, const unsigned int, const unsigned int);
+
+static BlurRowFunction pickBlurRow() {
+#ifdef WAZAT_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    return blurRowAvx2;
+  }
+  return blurRowSse2;
+#endif
+  return blurRowScalar;
+}
+
+static BlurColumnFunction pickBlurColumn() {
+#ifdef WAZAT_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    return blurColumnAvx2;
+  }
+  return blurColumnSse2;
+#endif
+  return blurColumnScalar;
 }
 
 void blur(struct buffer<uint8_t>& inputBuffer,
@@ -36,433 +245,598 @@ void blur(struct buffer<uint8_t>& inputBuffer,
           const int height,
           const int gausKernelSize,
           const double gausSigma) {
-  static struct buffer<uint8_t> tmpBuffer = {0};
-  tmpBuffer.resize(inputBuffer.length);
-
-  const int radius = (gausKernelSize - 1) / 2;
-  static Matrix k = getGaussian(gausKernelSize, gausSigma);
+  static const BlurRowFunction blurRow = pickBlurRow();
+  static const BlurColumnFunction blurColumn = pickBlurColumn();
+  static std::vector<int16_t> weights = getGaussian(gausKernelSize, gausSigma);
   static int gausKernelSize_ = gausKernelSize;
   static double gausSigma_ = gausSigma;
 
   if(gausKernelSize_ != gausKernelSize || gausSigma_ != gausSigma) {
     gausKernelSize_ = gausKernelSize;
     gausSigma_ = gausSigma;
-    k = getGaussian(gausKernelSize, gausSigma);
+    weights = getGaussian(gausKernelSize, gausSigma);
   }
 
-  for(int y = radius; y < height - radius; y++) {
-    for(int x = radius *3; x < (width - radius) * 3; x += 3) {
-      for(int c = 0; c < 3; c++) {
-        //assert(y * width * 3 + x + c >= 0);
-        //assert(y * width * 3 + x + c < width * height * 3);
-        ((uint8_t*)tmpBuffer.start)[y * width * 3 + x + c] = 0;
-
-        for(int ky = -radius; ky <= radius; ky++) {
-          for(int kx = -radius; kx <= radius; kx++) {
-            const int address =
-              (y + ky) * width * 3 + x + kx * 3 + c;
-            //assert(address >= 0);
-            //assert(address < width * height * 3);
-
-            ((uint8_t*)tmpBuffer.start)[y * width * 3 + x + c] +=
-              k[kx + radius][ky + radius] * ((uint8_t*)inputBuffer.start)[address];
-          }
-        }
-        //assert(tempBuffer.start[y * width * 3 + x + c] >= 0);
-        //assert(tempBuffer.start[y * width * 3 + x + c] <= 0xFF);
+  const int size = weights.size();
+  const int radius = (size - 1) / 2;
+  const unsigned int rowLength = width * 3;
+  assert(size <= BLUR_MAX_KERNEL);
+  if(size < 2 || width <= 0 || height <= 0) {
+    return;
+  }
+
+  // The horizontal pass fills a window of the last size rows, indexed by
+  // source row modulo size. Each output row is written back over the input
+  // as soon as its window is complete. Rows still to be read lie below the
+  // one being written, so working in place is safe and nothing frame sized
+  // is ever copied.
+  static struct buffer<uint8_t> padded = {0};
+  static struct buffer<uint16_t> window = {0};
+  padded.resize(rowLength + 2 * radius * 3);
+  window.resize(rowLength * size);
+
+  uint8_t* image = inputBuffer.start;
+  const uint16_t* rows[BLUR_MAX_KERNEL];
+  int filled = 0;  // Source rows through the horizontal pass so far.
+
+  for(int y = 0; y < height; y++) {
+    const int last = std::min(y + radius, height - 1);
+    for(; filled <= last; filled++) {
+      const uint8_t* source = image + filled * rowLength;
+      // Clamp at the left and right edges by replicating the end pixels.
+      for(int x = 0; x < radius; x++) {
+        memcpy(padded.start + x * 3, source, 3);
+        memcpy(padded.start + (radius + width + x) * 3, source + rowLength - 3, 3);
       }
+      memcpy(padded.start + radius * 3, source, rowLength);
+      blurRow(padded.start, window.start + (filled % size) * rowLength,
+              weights.data(), size, 0, rowLength);
     }
+
+    // Clamp at the top and bottom edges by reusing the end rows.
+    for(int k = 0; k < size; k++) {
+      const int row = std::min(std::max(y + k - radius, 0), height - 1);
+      rows[k] = window.start + (row % size) * rowLength;
+    }
+    blurColumn(rows, image + y * rowLength, weights.data(), size, 0, rowLength);
   }
+}
 
-  memcpy(inputBuffer.start, tmpBuffer.start, inputBuffer.length);
-  //std::swap(tmpBuffer.start, inputBuffer.start);
+int boxRadiusForSigma(const double sigma, const int passes) {
+  // n passes of a box of width w have variance n * (w * w - 1) / 12.
+  const double idealWidth = sqrt(12 * sigma * sigma / passes + 1);
+  return std::max(1, (int)lround((idealWidth - 1) / 2));
 }
 
-void getFeatures(struct buffer<uint8_t>& inputBuffer,
-                 std::vector<uint8_t>& featureBuffer,
-                 const unsigned int width,
-                 const unsigned int height,
-                 int thresholdColour,
-                 int thresholdBrightness,
-                 int border) {
-
-  featureBuffer.clear(); 
-  if(featureBuffer.size() < inputBuffer.length / 3) {
-    featureBuffer.resize(inputBuffer.length / 3);
-  }
-  
-  for(unsigned int x = border; x < width -border; x++) {
-    for(unsigned int y = border; y < height -border; y++) {
-      int dxR = ((uint8_t*)inputBuffer.start)[3*(x + y * width) +0] -
-                     ((uint8_t*)inputBuffer.start)[3*(x + y * width -border) +0];
-      int dxG = ((uint8_t*)inputBuffer.start)[3*(x + y * width) +1] -
-                     ((uint8_t*)inputBuffer.start)[3*(x + y * width -border) +1];
-      int dxB = ((uint8_t*)inputBuffer.start)[3*(x + y * width) +2] -
-                     ((uint8_t*)inputBuffer.start)[3*(x + y * width -border) +2];
-      int dyR = ((uint8_t*)inputBuffer.start)[3*(x + y * width) +0] -
-                     ((uint8_t*)inputBuffer.start)[3*(x + (y -border) * width) +0];
-      int dyG = ((uint8_t*)inputBuffer.start)[3*(x + y * width) +1] -
-                     ((uint8_t*)inputBuffer.start)[3*(x + (y -border) * width) +1];
-      int dyB = ((uint8_t*)inputBuffer.start)[3*(x + y * width) +2] -
-                     ((uint8_t*)inputBuffer.start)[3*(x + (y -border) * width) +2];
-
-      if(abs(dxR - dxG) + abs(dxG - dxB) + abs(dxB - dxR) +
-          abs(dyR - dyG) + abs(dyG - dyB) + abs(dyB - dyR) > thresholdColour) {
-        if(abs(dxR) + abs(dxG) + abs(dxB) + abs(dyR) + abs(dyG) + abs(dyB) >
-            thresholdBrightness) {
-          featureBuffer[x + y * width] = 1;
-          /*featureBuffer[x -1 + (y -1) * width] = 1;
-          featureBuffer[x +0 + (y -1) * width] = 1;
-          featureBuffer[x +1 + (y -1) * width] = 1;
-          featureBuffer[x -1 + y * width] = 1;
-          featureBuffer[x +1 + y * width] = 1;
-          featureBuffer[x -1 + (y +1) * width] = 1;
-          featureBuffer[x +0 + (y +1) * width] = 1;
-          featureBuffer[x +1 + (y +1) * width] = 1;*/
+void boxBlur(struct buffer<uint8_t>& inputBuffer,
+             const int width,
+             const int height,
+             const int radius,
+             const int passes) {
+  // Limits the largest window so the reciprocals below stay exact.
+  assert(radius > 0 && radius <= BOX_MAX_RADIUS);
+  static IntegralImage integral;
+
+  // Dividing by the window area is a multiply by a rounded up 32 bit
+  // reciprocal. For sums under 2^32 / area that gives the exact quotient.
+  const int side = 2 * radius + 1;
+  std::vector<uint64_t> reciprocal(side * side + 1);
+  for(size_t area = 1; area < reciprocal.size(); area++) {
+    reciprocal[area] = ((1ull << 32) + area - 1) / area;
+  }
+
+  // Window edges clipped to the frame, the same for every row.
+  std::vector<int> left(width);
+  std::vector<int> right(width);
+  for(int x = 0; x < width; x++) {
+    left[x] = std::max(x - radius, 0);
+    right[x] = std::min(x + radius + 1, width);
+  }
+
+  uint8_t* image = inputBuffer.start;
+  for(int pass = 0; pass < passes; pass++) {
+    for(int c = 0; c < 3; c++) {
+      // The table holds the whole channel before any of it is overwritten.
+      integral.build(image + c, width, height, width * 3, 3);
+      for(int y = 0; y < height; y++) {
+        const int top = std::max(y - radius, 0);
+        const int bottom = std::min(y + radius + 1, height);
+        const uint32_t* above = integral.row(top);
+        const uint32_t* below = integral.row(bottom);
+        uint8_t* out = image + y * width * 3 + c;
+        for(int x = 0; x < width; x++) {
+          const int area = (bottom - top) * (right[x] - left[x]);
+          const uint32_t sum = below[right[x]] - below[left[x]] -
+                               above[right[x]] + above[left[x]];
+          out[x * 3] = ((uint64_t)(sum + area / 2) * reciprocal[area]) >> 32;
         }
       }
     }
   }
 }
 
-void filterThin(std::vector<uint8_t>& featureBuffer, 
-                const unsigned int width,
-                const unsigned int height,
-                const int trim,
-                int maxIterations) {
-  // http://fourier.eng.hmc.edu/e161/lectures/morphology/node2.html
-  uint8_t tempBuffer[width * height] = {};
-  int border = 1;
-  int count = 1;
-  int pass = 0;
-  while(count && maxIterations) {
-    count = 0;
-    maxIterations--;
-    pass++;
-    for(unsigned int x = border; x < width - border; x++) {
-      for(unsigned int y = border; y < height - border; y++) {
-        if(featureBuffer[x + y * width]) {
-          assert(featureBuffer[x + y * width] == 1);
-          int n = 
-            featureBuffer[(x - 1) + (y - 1) * width] +
-            featureBuffer[(x + 0) + (y - 1) * width] +
-            featureBuffer[(x + 1) + (y - 1) * width] +
-            featureBuffer[(x - 1) + (y + 0) * width] +
-            featureBuffer[(x + 1) + (y + 0) * width] +
-            featureBuffer[(x - 1) + (y + 1) * width] +
-            featureBuffer[(x + 0) + (y + 1) * width] +
-            featureBuffer[(x + 1) + (y + 1) * width];
-          int s = 0;
-          s += (featureBuffer[(x - 1) + (y - 1) * width] == 0) &&
-                featureBuffer[(x + 0) + (y - 1) * width];
-          s += (featureBuffer[(x + 0) + (y - 1) * width] == 0) &&
-                featureBuffer[(x + 1) + (y - 1) * width];
-          s += (featureBuffer[(x + 1) + (y - 1) * width] == 0) &&
-                featureBuffer[(x + 1) + (y + 0) * width];
-          s += (featureBuffer[(x + 1) + (y + 0) * width] == 0) &&
-                featureBuffer[(x + 1) + (y + 1) * width];
-          s += (featureBuffer[(x + 1) + (y + 1) * width] == 0) &&
-                featureBuffer[(x + 0) + (y + 1) * width];
-          s += (featureBuffer[(x + 0) + (y + 1) * width] == 0) &&
-                featureBuffer[(x - 1) + (y + 1) * width];
-          s += (featureBuffer[(x - 1) + (y + 1) * width] == 0) &&
-                featureBuffer[(x - 1) + (y + 0) * width];
-          s += (featureBuffer[(x - 1) + (y + 0) * width] == 0) &&
-                featureBuffer[(x - 1) + (y - 1) * width];
-
-          if(pass %2){
-            if((n >= trim) && (n < 7) && (s < 2) &&
-                (featureBuffer[(x + 0) + (y - 1) * width] *
-                 featureBuffer[(x + 1) + (y + 0) * width] *
-                 featureBuffer[(x + 0) + (y + 1) * width] == 0) &&
-                (featureBuffer[(x + 1) + (y + 0) * width] *
-                 featureBuffer[(x + 0) + (y + 1) * width] *
-                 featureBuffer[(x - 1) + (y + 0) * width] == 0)) {
-              tempBuffer[x + y * width] = 0;
-            } else {
-              tempBuffer[x + y * width] = 1;
-            }
-          } else {
-            if((n >= trim) && (n < 7) && (s < 2) &&
-                (featureBuffer[(x + 0) + (y - 1) * width] *
-                 featureBuffer[(x + 1) + (y + 0) * width] *
-                 featureBuffer[(x - 1) + (y + 0) * width] == 0) &&
-                (featureBuffer[(x + 0) + (y - 1) * width] *
-                 featureBuffer[(x + 0) + (y + 1) * width] *
-                 featureBuffer[(x - 1) + (y + 0) * width] == 0)) {
-              tempBuffer[x + y * width] = 0;
-            } else {
-              tempBuffer[x + y * width] = 1;
-            }
-          }
+/* getFeatures() works a row at a time on planar copies of the channels. For
+ * each pixel and channel c, with d = border:
+ *   dx[c] = P(x, y)[c] - P(x - d, y)[c]
+ *   dy[c] = P(x, y)[c] - P(x, y - d)[c]
+ * and the pixel is a feature when both
+ *   |dxR - dxG| + |dxG - dxB| + |dxB - dxR| + (the same for dy) > thresholdColour
+ *   |dxR| + |dxG| + |dxB| + |dyR| + |dyG| + |dyB| > thresholdBrightness
+ * The sums are at most 3060 and 1530 so every step fits a 16 bit lane. */
+
+/* Split count RGB24 pixels into three planes. */
+static void deinterleaveScalar(const uint8_t* rgb,
+                               uint8_t* const planes[3],
+                               const unsigned int start,
+                               const unsigned int count) {
+  for(unsigned int x = start; x < count; x++) {
+    planes[0][x] = rgb[3 * x + 0];
+    planes[1][x] = rgb[3 * x + 1];
+    planes[2][x] = rgb[3 * x + 2];
+  }
+}
 
-        }
-      }
+static void featureRowScalar(const uint8_t* const current[3],
+                             const uint8_t* const above[3],
+                             FeatureMap& mask,
+                             const unsigned int y,
+                             const int border,
+                             const int thresholdColour,
+                             const int thresholdBrightness,
+                             const unsigned int start,
+                             const unsigned int end) {
+  for(unsigned int x = start; x < end; x++) {
+    int dx[3];
+    int dy[3];
+    for(int c = 0; c < 3; c++) {
+      dx[c] = current[c][x] - current[c][x - border];
+      dy[c] = current[c][x] - above[c][x];
+    }
+    const int colour =
+      abs(dx[0] - dx[1]) + abs(dx[1] - dx[2]) + abs(dx[2] - dx[0]) +
+      abs(dy[0] - dy[1]) + abs(dy[1] - dy[2]) + abs(dy[2] - dy[0]);
+    const int brightness =
+      abs(dx[0]) + abs(dx[1]) + abs(dx[2]) + abs(dy[0]) + abs(dy[1]) + abs(dy[2]);
+    if(colour > thresholdColour && brightness > thresholdBrightness) {
+      mask.set(x, y);
     }
-    for(unsigned int i = 0; i < width * height; i++) {
-      if(featureBuffer[i] != tempBuffer[i]) {
-        count++;
+  }
+}
+
+#ifdef WAZAT_X86
+
+__attribute__((target("ssse3")))
+static void deinterleaveSsse3(const uint8_t* rgb,
+                              uint8_t* const planes[3],
+                              const unsigned int start,
+                              const unsigned int count) {
+  // For each channel, where its 16 bytes sit in each of the 3 source loads.
+  const __m128i shuffle[3][3] = {
+    {_mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+     _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1),
+     _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)},
+    {_mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+     _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1),
+     _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)},
+    {_mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+     _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1),
+     _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)}
+  };
+  unsigned int x = start;
+  for(; x + 16 <= count; x += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i*)(rgb + 3 * x));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(rgb + 3 * x + 16));
+    const __m128i c = _mm_loadu_si128((const __m128i*)(rgb + 3 * x + 32));
+    for(int channel = 0; channel < 3; channel++) {
+      _mm_storeu_si128((__m128i*)(planes[channel] + x), _mm_or_si128(
+          _mm_or_si128(_mm_shuffle_epi8(a, shuffle[channel][0]),
+                       _mm_shuffle_epi8(b, shuffle[channel][1])),
+          _mm_shuffle_epi8(c, shuffle[channel][2])));
+    }
+  }
+  deinterleaveScalar(rgb, planes, x, count);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i absSse2(const __m128i v) {
+  return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+__attribute__((target("sse2")))
+static void featureRowSse2(const uint8_t* const current[3],
+                           const uint8_t* const above[3],
+                           FeatureMap& mask,
+                           const unsigned int y,
+                           const int border,
+                           const int thresholdColour,
+                           const int thresholdBrightness,
+                           const unsigned int start,
+                           const unsigned int end) {
+  const __m128i zero = _mm_setzero_si128();
+  // The sums can't leave [0, 3060], so clamping keeps the comparison exact.
+  const __m128i colourLimit =
+    _mm_set1_epi16(std::max(-1, std::min(thresholdColour, 0x7fff)));
+  const __m128i brightnessLimit =
+    _mm_set1_epi16(std::max(-1, std::min(thresholdBrightness, 0x7fff)));
+  unsigned int x = start;
+  for(; x + 16 <= end; x += 16) {
+    __m128i passed[2];
+    for(int half = 0; half < 2; half++) {
+      const unsigned int at = x + 8 * half;
+      __m128i dx[3];
+      __m128i dy[3];
+      for(int c = 0; c < 3; c++) {
+        const __m128i here = _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i*)(current[c] + at)), zero);
+        dx[c] = _mm_sub_epi16(here, _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i*)(current[c] + at - border)), zero));
+        dy[c] = _mm_sub_epi16(here, _mm_unpacklo_epi8(
+            _mm_loadl_epi64((const __m128i*)(above[c] + at)), zero));
       }
-      featureBuffer[i] = tempBuffer[i];
+      __m128i colour = absSse2(_mm_sub_epi16(dx[0], dx[1]));
+      colour = _mm_add_epi16(colour, absSse2(_mm_sub_epi16(dx[1], dx[2])));
+      colour = _mm_add_epi16(colour, absSse2(_mm_sub_epi16(dx[2], dx[0])));
+      colour = _mm_add_epi16(colour, absSse2(_mm_sub_epi16(dy[0], dy[1])));
+      colour = _mm_add_epi16(colour, absSse2(_mm_sub_epi16(dy[1], dy[2])));
+      colour = _mm_add_epi16(colour, absSse2(_mm_sub_epi16(dy[2], dy[0])));
+      __m128i brightness = _mm_add_epi16(absSse2(dx[0]), absSse2(dx[1]));
+      brightness = _mm_add_epi16(brightness, absSse2(dx[2]));
+      brightness = _mm_add_epi16(brightness, absSse2(dy[0]));
+      brightness = _mm_add_epi16(brightness, absSse2(dy[1]));
+      brightness = _mm_add_epi16(brightness, absSse2(dy[2]));
+      passed[half] = _mm_and_si128(_mm_cmpgt_epi16(colour, colourLimit),
+                                   _mm_cmpgt_epi16(brightness, brightnessLimit));
     }
+    mask.setBits(x, y, _mm_movemask_epi8(_mm_packs_epi16(passed[0], passed[1])), 16);
   }
+  featureRowScalar(current, above, mask, y, border, thresholdColour,
+                   thresholdBrightness, x, end);
 }
 
-void merge(struct buffer<uint8_t>& finalBuffer,
-           std::vector<uint8_t>& featureBuffer,
-           const unsigned int width,
-           const unsigned int height) {
-  assert(width * height <= featureBuffer.size());
-  for(unsigned int x = 0; x < width; x++) {
-    for(unsigned int y = 0; y < height; y++) {
-      if(featureBuffer[x + y * width]) {
-        ((uint8_t*)finalBuffer.start)[(x + y * width) * 3 + 0] = 255;
-        ((uint8_t*)finalBuffer.start)[(x + y * width) * 3 + 1] = 255;
-        ((uint8_t*)finalBuffer.start)[(x + y * width) * 3 + 2] = 255;
+__attribute__((target("avx2")))
+static void featureRowAvx2(const uint8_t* const current[3],
+                           const uint8_t* const above[3],
+                           FeatureMap& mask,
+                           const unsigned int y,
+                           const int border,
+                           const int thresholdColour,
+                           const int thresholdBrightness,
+                           const unsigned int start,
+                           const unsigned int end) {
+  const __m256i colourLimit =
+    _mm256_set1_epi16(std::max(-1, std::min(thresholdColour, 0x7fff)));
+  const __m256i brightnessLimit =
+    _mm256_set1_epi16(std::max(-1, std::min(thresholdBrightness, 0x7fff)));
+  unsigned int x = start;
+  for(; x + 32 <= end; x += 32) {
+    __m256i passed[2];
+    for(int half = 0; half < 2; half++) {
+      const unsigned int at = x + 16 * half;
+      __m256i dx[3];
+      __m256i dy[3];
+      for(int c = 0; c < 3; c++) {
+        const __m256i here = _mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i*)(current[c] + at)));
+        dx[c] = _mm256_sub_epi16(here, _mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i*)(current[c] + at - border))));
+        dy[c] = _mm256_sub_epi16(here, _mm256_cvtepu8_epi16(
+            _mm_loadu_si128((const __m128i*)(above[c] + at))));
       }
+      __m256i colour = _mm256_abs_epi16(_mm256_sub_epi16(dx[0], dx[1]));
+      colour = _mm256_add_epi16(colour, _mm256_abs_epi16(_mm256_sub_epi16(dx[1], dx[2])));
+      colour = _mm256_add_epi16(colour, _mm256_abs_epi16(_mm256_sub_epi16(dx[2], dx[0])));
+      colour = _mm256_add_epi16(colour, _mm256_abs_epi16(_mm256_sub_epi16(dy[0], dy[1])));
+      colour = _mm256_add_epi16(colour, _mm256_abs_epi16(_mm256_sub_epi16(dy[1], dy[2])));
+      colour = _mm256_add_epi16(colour, _mm256_abs_epi16(_mm256_sub_epi16(dy[2], dy[0])));
+      __m256i brightness = _mm256_add_epi16(_mm256_abs_epi16(dx[0]), _mm256_abs_epi16(dx[1]));
+      brightness = _mm256_add_epi16(brightness, _mm256_abs_epi16(dx[2]));
+      brightness = _mm256_add_epi16(brightness, _mm256_abs_epi16(dy[0]));
+      brightness = _mm256_add_epi16(brightness, _mm256_abs_epi16(dy[1]));
+      brightness = _mm256_add_epi16(brightness, _mm256_abs_epi16(dy[2]));
+      passed[half] = _mm256_and_si256(_mm256_cmpgt_epi16(colour, colourLimit),
+                                      _mm256_cmpgt_epi16(brightness, brightnessLimit));
     }
+    // The pack interleaves lanes. Put the quarters back in order.
+    const __m256i packed = _mm256_packs_epi16(passed[0], passed[1]);
+    mask.setBits(x, y, (uint32_t)_mm256_movemask_epi8(
+        _mm256_permute4x64_epi64(packed, 0xd8)), 32);
   }
+  featureRowSse2(current, above, mask, y, border, thresholdColour,
+                 thresholdBrightness, x, end);
 }
 
-void filterSmallFeatures(std::vector<uint8_t>& featureBuffer,
-            const unsigned int width,
-            const unsigned int height) {
-  unsigned int border = 10;
+#endif  // WAZAT_X86
 
-  unsigned int minBorder = 1;
-  if(border > 1) {
+typedef void (*DeinterleaveFunction)(const uint8_t*, uint8_t* const[3],
+                                     const unsigned int, const unsigned int);
+typedef void (*FeatureRowFunction)(const uint8_t* const[3], const uint8_t* const[3],
+                                   FeatureMap&, const unsigned int,
+                                   const int, const int, const int,
+                                   const unsigned int, const unsigned int);
 
-    // TODO: Work out why the first loop of border behaves differently when
-    // border > 1.
-    minBorder = 2;
+static DeinterleaveFunction pickDeinterleave() {
+#ifdef WAZAT_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("ssse3")) {
+    return deinterleaveSsse3;
   }
+#endif
+  return deinterleaveScalar;
+}
 
-  for(unsigned int x = border; x < width - border; x++) {
-    for(unsigned int y = border; y < height - border; y++) {
-
-      if(featureBuffer[x + y * width]) {
-        int foundNeighbour = 0;
-        for(unsigned int b = minBorder; b <= border; b++) {
-          foundNeighbour = 0;
-          unsigned int xxL = x - b;
-          unsigned int xxR = x + b;
-          unsigned int yyT = y - b;
-          unsigned int yyB = y + b;
-          for(unsigned int xx = x - b; xx <= x + b; xx++) {
-            assert(xx + yyT * width != x + y * width);
-            assert(xx + yyB * width != x + y * width);
-            if(featureBuffer[xx + yyT * width] ||
-                featureBuffer[xx + yyB * width]) {
-              foundNeighbour = 1;
-              break;
-            }
-          }
-          for(unsigned int yy = y - b; yy <= y + b && !foundNeighbour; yy++) {
-            if(featureBuffer[xxL + yy * width] ||
-                featureBuffer[xxR + yy * width]) {
-              foundNeighbour = 1;
-              break;
-            }
-          }
-          if(!foundNeighbour) {
-            featureBuffer[x + y * width] = 0;
-            break;
-          }
-        }
-      }
+static FeatureRowFunction pickFeatureRow() {
+#ifdef WAZAT_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    return featureRowAvx2;
+  }
+  return featureRowSse2;
+#endif
+  return featureRowScalar;
+}
 
+/* Hough angle column of the edge normal at (x, y), taken from whichever
+ * channel changes most there. The gradient is the difference between the
+ * outer columns, and between the outer rows, of the (border + 1) square
+ * ending at (x, y). Single differences would saturate to 45 degrees on any
+ * slanted edge wider than a pixel. Opposite gradients give the same column. */
+static uint8_t featureOrientation(const uint8_t* planes,
+                                  const unsigned int width,
+                                  const unsigned int ringSize,
+                                  const unsigned int x,
+                                  const unsigned int y,
+                                  const int border) {
+  int gradientX = 0;
+  int gradientY = 0;
+  int strongest = -1;
+  for(int c = 0; c < 3; c++) {
+    const uint8_t* const top = planes + (3 * ((y - border) % ringSize) + c) * width;
+    const uint8_t* const bottom = planes + (3 * (y % ringSize) + c) * width;
+    int dx = 0;
+    int dy = 0;
+    for(int step = 0; step <= border; step++) {
+      const uint8_t* const row = planes + (3 * ((y - step) % ringSize) + c) * width;
+      dx += row[x] - row[x - border];
+      dy += bottom[x - step] - top[x - step];
     }
+    if(abs(dx) + abs(dy) > strongest) {
+      strongest = abs(dx) + abs(dy);
+      gradientX = dx;
+      gradientY = dy;
+    }
+  }
+  // Fold (-180, 180] degrees into the accumulator's [-90, 90).
+  int angle = (int)lround(atan2((double)gradientY, (double)gradientX) * 180 / M_PI);
+  if(angle >= HOUGH_ANGLES / 2) {
+    angle -= HOUGH_ANGLES;
+  } else if(angle < -HOUGH_ANGLES / 2) {
+    angle += HOUGH_ANGLES;
   }
+  return (uint8_t)(angle + HOUGH_ANGLES / 2);
 }
 
-void filterHough(std::vector<uint8_t>& inputBuffer,
-                 struct buffer<uint16_t>& outputBuffer,
+void getFeatures(struct buffer<uint8_t>& inputBuffer,
+                 FeatureMap& featureBuffer,
                  const unsigned int width,
-                 const unsigned int height) {
-  static const int16_t maxLineLen = sqrt(width * width + height * height);
-
-  outputBuffer.resize(2 * maxLineLen * 360);
-  outputBuffer.resize(2 * maxLineLen * 360);
-  outputBuffer.clear();
-
-  for(unsigned int x = 10; x < width -10; x++) {
-    for(unsigned int y = 10; y < height -10; y++) {
-      if(inputBuffer[x + y * width]) {
-        for(int16_t a = -180; a < 180; a++) {
-          int r = x * cos(M_PI * a / 180) + y * sin(M_PI * a / 180);
-          int rOffset = r + maxLineLen;
-          int16_t aOffset = a + 180;
-          if(r < -maxLineLen || r >= maxLineLen) {
-            std::cout << r << std::endl;
-            assert(0);
-          }
-          uint16_t* value = &(outputBuffer.start[rOffset * 360 + aOffset]);
-          if(*value < 0xffff -1) {
-            (*value)++;
-          }
-        }
-      }
-    }
+                 const unsigned int height,
+                 int thresholdColour,
+                 int thresholdBrightness,
+                 int border,
+                 struct buffer<uint8_t>* orientation) {
+  static const DeinterleaveFunction deinterleave = pickDeinterleave();
+  static const FeatureRowFunction featureRow = pickFeatureRow();
+
+  featureBuffer.resize(width, height);
+  if(orientation) {
+    orientation->resize(width * height);
+  }
+  if(border < 0 || width <= (unsigned int)border || height <= (unsigned int)border) {
+    return;
   }
 
-  /*for(int rOffset = 0; rOffset < 2 * maxLineLen; rOffset++) {
-    uint16_t* lastValue = nullptr;
-    for(int16_t aOffset = 1; aOffset < 360; aOffset++) {
-      uint16_t* value = &(tmpBuffer2.start[rOffset * 360 + aOffset]);
-      if(lastValue && *lastValue > 170 && *lastValue > *value) {
-        outputBuffer.start[rOffset * 360 + aOffset -1] = 1;
-      } else {
-        outputBuffer.start[rOffset * 360 + aOffset -1] = 0;
-      }
-      lastValue = value;
+  // Planar copies of the last border + 1 rows, indexed by row modulo
+  // border + 1, so row y - border is still there when row y arrives.
+  static struct buffer<uint8_t> planes = {0};
+  const unsigned int ringSize = border + 1;
+  planes.resize(3 * width * ringSize);
+
+  for(unsigned int y = 0; y < height - border; y++) {
+    uint8_t* const current[3] = {
+      planes.start + (3 * (y % ringSize) + 0) * width,
+      planes.start + (3 * (y % ringSize) + 1) * width,
+      planes.start + (3 * (y % ringSize) + 2) * width
+    };
+    deinterleave(inputBuffer.start + 3 * y * width, current, 0, width);
+    if(y < (unsigned int)border) {
+      continue;
     }
-  }*/
-}
-
-void dilateHough(struct buffer<uint16_t>& houghBuffer,
-                  const unsigned int width,
-                  const unsigned int height) {
-  static const int16_t maxLineLen = sqrt(width * width + height * height);
-
-  static struct buffer<uint16_t> tmpBuffer = {0};
-  tmpBuffer.resize(2 * maxLineLen * 360);
-  tmpBuffer.clear();
 
-  for(size_t aOffset = 1; aOffset < 360 -1; aOffset++) {
-    for(int rOffset = 1; rOffset < 2 * maxLineLen -1; rOffset++) {
-      uint16_t* value = &(tmpBuffer.start[rOffset * 360 + aOffset]);
-      *value = houghBuffer.start[rOffset * 360 + aOffset];
-
-      if(houghBuffer.start[(rOffset -1) * 360 + aOffset -1] >= *value) {
-        *value = houghBuffer.start[(rOffset -1) * 360 + aOffset -1];
-      }
-      if(houghBuffer.start[(rOffset +0) * 360 + aOffset -1] >= *value) {
-        *value = houghBuffer.start[(rOffset +0) * 360 + aOffset -1];
-      }
-      if(houghBuffer.start[(rOffset +1) * 360 + aOffset -1] >= *value) {
-        *value = houghBuffer.start[(rOffset +1) * 360 + aOffset -1];
-      }
-      if(houghBuffer.start[(rOffset -1) * 360 + aOffset +0] >= *value) {
-        *value = houghBuffer.start[(rOffset -1) * 360 + aOffset +0];
-      }
-      if(houghBuffer.start[(rOffset +1) * 360 + aOffset +0] >= *value) {
-        *value = houghBuffer.start[(rOffset +1) * 360 + aOffset +0];
-      }
-      if(houghBuffer.start[(rOffset -1) * 360 + aOffset +1] >= *value) {
-        *value = houghBuffer.start[(rOffset -1) * 360 + aOffset +1];
-      }
-      if(houghBuffer.start[(rOffset +0) * 360 + aOffset +1] >= *value) {
-        *value = houghBuffer.start[(rOffset +0) * 360 + aOffset +1];
-      }
-      if(houghBuffer.start[(rOffset +1) * 360 + aOffset +1] >= *value) {
-        *value = houghBuffer.start[(rOffset +1) * 360 + aOffset +1];
-      }
+    const unsigned int previous = (y - border) % ringSize;
+    const uint8_t* const above[3] = {
+      planes.start + (3 * previous + 0) * width,
+      planes.start + (3 * previous + 1) * width,
+      planes.start + (3 * previous + 2) * width
+    };
+    featureRow(current, above, featureBuffer, y, border,
+               thresholdColour, thresholdBrightness, border, width - border);
+    if(orientation) {
+      // Only for the pixels that passed, so the row kernels stay as they are.
+      featureBuffer.forEachSet(border, y, width - border, y + 1,
+                               [&](const unsigned int x, const unsigned int) {
+        orientation->start[y * width + x] =
+          featureOrientation(planes.start, width, ringSize, x, y, border);
+      });
     }
   }
-  memcpy(houghBuffer.start, tmpBuffer.start, houghBuffer.length * sizeof(uint16_t));
 }
 
-size_t erodeHough(struct buffer<uint16_t>& houghBuffer,
-               const unsigned int width,
-               const unsigned int height,
-               const double threshold) {
-  static const int16_t maxLineLen = sqrt(width * width + height * height);
-
-  static struct buffer<uint16_t> tmpBuffer = {0};
-  tmpBuffer.resize(2 * maxLineLen * 360);
-  tmpBuffer.clear();
-
-  size_t count = 0;
-
-  for(size_t aOffset = 1; aOffset < 360 -1; aOffset++) {
-    for(int rOffset = 1; rOffset < 2 * maxLineLen -1; rOffset++) {
-      uint16_t center = houghBuffer.start[rOffset * 360 + aOffset];
-      uint16_t tl = houghBuffer.start[(rOffset -1) * 360 + aOffset -1];
-      uint16_t tc = houghBuffer.start[(rOffset +0) * 360 + aOffset -1];
-      uint16_t tr = houghBuffer.start[(rOffset +1) * 360 + aOffset -1];
-      uint16_t lc = houghBuffer.start[(rOffset -1) * 360 + aOffset +0];
-      uint16_t rc = houghBuffer.start[(rOffset +1) * 360 + aOffset +0];
-      uint16_t bl = houghBuffer.start[(rOffset -1) * 360 + aOffset +1];
-      uint16_t bc = houghBuffer.start[(rOffset +0) * 360 + aOffset +1];
-      uint16_t br = houghBuffer.start[(rOffset +1) * 360 + aOffset +1];
-      bool tlb = tl >= center;
-      bool tcb = tc >= center;
-      bool trb = tr >= center;
-      bool lcb = lc >= center;
-      bool rcb = rc >= center;
-      bool blb = bl >= center;
-      bool bcb = bc >= center;
-      bool brb = br >= center;
-
-      if(center < threshold ||
-          tl > center || tc > center || tr > center || lc > center ||
-          rc > center || bl > center || bc > center || br > center) {
-        tmpBuffer.start[rOffset * 360 + aOffset] = 0;
-      } else {
-        uint8_t transitionCount = 0;
-        uint8_t setCount = tlb + tcb + trb + lcb + rcb + blb + bcb + brb;
-        if(tlb != tcb) { transitionCount++; }
-        if(tcb != trb) { transitionCount++; }
-        if(trb != rcb) { transitionCount++; }
-        if(rcb != brb) { transitionCount++; }
-        if(brb != bcb) { transitionCount++; }
-        if(bcb != blb) { transitionCount++; }
-        if(blb != lcb) { transitionCount++; }
-        if(lcb != tlb) { transitionCount++; }
-        assert(transitionCount % 2 == 0);
-        if(transitionCount == 2){
-          if(setCount > 1) {
-            tmpBuffer.start[rOffset * 360 + aOffset] = 0;
-            count++;
-          } else if(rcb || blb || bcb || brb) {
-            // Lower end of line.
-            tmpBuffer.start[rOffset * 360 + aOffset] = 0;
-            count++;
-          } else {
-            // Upper end of line.
-            tmpBuffer.start[rOffset * 360 + aOffset] = center;
-          }
-        } else {
-          tmpBuffer.start[rOffset * 360 + aOffset] = center;
-        }
-      }
-    }
+/* Which neighbourhoods filterThin() removes, indexed by the packed
+ * neighbourhood from FeatureMap::neighbours(). table[1] is for odd passes,
+ * table[0] for even ones. */
+static void buildThinTables(const int trim, bool table[2][256]) {
+  for(unsigned int code = 0; code < 256; code++) {
+    const int n = __builtin_popcount(code);
+    // 0 to 1 transitions going once round.
+    const int s = __builtin_popcount(~code & ((code >> 1) | (code << 7)) & 0xff);
+    const int north = code & 1;
+    const int east = (code >> 2) & 1;
+    const int south = (code >> 4) & 1;
+    const int west = (code >> 6) & 1;
+    const bool thin = (n >= trim) && (n < 7) && (s < 2);
+    table[1][code] = thin && (north * east * south == 0) && (east * south * west == 0);
+    table[0][code] = thin && (north * east * west == 0) && (north * south * west == 0);
   }
-  memcpy(houghBuffer.start, tmpBuffer.start, houghBuffer.length * sizeof(uint16_t));
-  return count;
 }
 
-void mergeHough(struct buffer<uint8_t>& finalBuffer,
-                struct buffer<uint16_t>& houghBuffer,
+struct ThinPixel {
+  uint16_t x;
+  uint16_t y;
+};
+
+void filterThin(FeatureMap& featureBuffer, 
                 const unsigned int width,
                 const unsigned int height,
-                const double threshold) {
-  const int16_t maxLineLen = sqrt(width * width + height * height);
-
-  if(houghBuffer.length == 0) {
+                const int trim,
+                int maxIterations) {
+  // http://fourier.eng.hmc.edu/e161/lectures/morphology/node2.html
+  // Every pixel in a pass is judged on the map as it was at the start of the
+  // pass. Only pixels that could go are visited: a pixel kept by both sub
+  // passes stays kept until one of its neighbours is removed, so after the
+  // first pass the worklist is the survivors the next sub pass would remove
+  // plus the neighbours of whatever was just removed.
+  static thread_local std::vector<ThinPixel> worklist;
+  static thread_local std::vector<ThinPixel> nextWorklist;
+  static thread_local std::vector<ThinPixel> removed;
+  static thread_local std::vector<ThinPixel> edges;
+  static thread_local FeatureMap queued;
+  bool table[2][256];
+  const unsigned int border = 1;
+
+  if(maxIterations <= 0) {
     return;
   }
+  if(width <= 2 * border || height <= 2 * border) {
+    featureBuffer.clear();
+    return;
+  }
+  assert(width <= 0xffff && height <= 0xffff);
+  buildThinTables(trim, table);
+
+  // Pixels on the outer border never survive the first pass, but they
+  // still count as neighbours during it.
+  edges.clear();
+  featureBuffer.forEachSet([&](const unsigned int x, const unsigned int y) {
+    if(x < border || y < border || x >= width - border || y >= height - border) {
+      edges.push_back({(uint16_t)x, (uint16_t)y});
+    }
+  });
+
+  worklist.clear();
+  featureBuffer.forEachSet(border, border, width - border, height - border,
+                           [&](const unsigned int x, const unsigned int y) {
+    const unsigned int code = featureBuffer.neighbours(x, y);
+    if(table[0][code] || table[1][code]) {
+      worklist.push_back({(uint16_t)x, (uint16_t)y});
+    }
+  });
+  queued.resize(width, height);
 
-  for(size_t aOffset = 0; aOffset < 360; aOffset++) {
-    for(int rOffset = 0; rOffset < 2 * maxLineLen; rOffset++) {
-      if(houghBuffer.start[rOffset * 360 + aOffset] > threshold) {
-        int16_t a = aOffset - 180;
-        int r = rOffset - maxLineLen;
-        int xStart = cos(M_PI * a / 180) * r;
-        int yStart = sin(M_PI * a / 180) * r;
-        for(int16_t l = -maxLineLen; l < maxLineLen; l++) {
-          uint16_t x = xStart + l * cos(M_PI * (a - 90) / 180);
-          uint16_t y = yStart + l * sin(M_PI * (a - 90) / 180);
-          if(x < width && y < height) {
-            finalBuffer.start[(x + y * width) * 3 + 0] = 0;
-            finalBuffer.start[(x + y * width) * 3 + 1] = 255;
-            finalBuffer.start[(x + y * width) * 3 + 2] = 255;
+  int pass = 0;
+  size_t count = 1;
+  while(count && maxIterations) {
+    maxIterations--;
+    pass++;
+    const bool* remove = table[pass % 2];
+    const bool* removeNext = table[(pass + 1) % 2];
+
+    removed.clear();
+    nextWorklist.clear();
+    for(const ThinPixel pixel : worklist) {
+      const unsigned int code = featureBuffer.neighbours(pixel.x, pixel.y);
+      if(remove[code]) {
+        removed.push_back(pixel);
+      } else if(removeNext[code] && !queued.get(pixel.x, pixel.y)) {
+        queued.set(pixel.x, pixel.y);
+        nextWorklist.push_back(pixel);
+      }
+    }
+    if(pass == 1) {
+      removed.insert(removed.end(), edges.begin(), edges.end());
+    }
+    for(const ThinPixel pixel : removed) {
+      featureBuffer.reset(pixel.x, pixel.y);
+    }
+    count = removed.size();
+
+    // Everything next to a removed pixel may have become removable.
+    for(const ThinPixel pixel : removed) {
+      for(int y = pixel.y - 1; y <= pixel.y + 1; y++) {
+        for(int x = pixel.x - 1; x <= pixel.x + 1; x++) {
+          if(x < (int)border || y < (int)border ||
+              x >= (int)(width - border) || y >= (int)(height - border)) {
+            continue;
+          }
+          if(featureBuffer.get(x, y) && !queued.get(x, y)) {
+            queued.set(x, y);
+            nextWorklist.push_back({(uint16_t)x, (uint16_t)y});
           }
         }
       }
     }
+    for(const ThinPixel pixel : nextWorklist) {
+      queued.reset(pixel.x, pixel.y);
+    }
+    std::swap(worklist, nextWorklist);
   }
-  houghBuffer.clear();
 }
 
+void merge(struct buffer<uint8_t>& finalBuffer,
+           const FeatureMap& featureBuffer,
+           const unsigned int width,
+           const unsigned int height) {
+  assert(width <= featureBuffer.width && height <= featureBuffer.height);
+  featureBuffer.forEachSet(0, 0, width, height,
+                           [&](const unsigned int x, const unsigned int y) {
+    ((uint8_t*)finalBuffer.start)[(x + y * width) * 3 + 0] = 255;
+    ((uint8_t*)finalBuffer.start)[(x + y * width) * 3 + 1] = 255;
+    ((uint8_t*)finalBuffer.start)[(x + y * width) * 3 + 2] = 255;
+  });
+}
+
+void filterSmallFeatures(FeatureMap& featureBuffer,
+            const unsigned int width,
+            const unsigned int height) {
+  unsigned int border = 10;
 
+  unsigned int minBorder = 1;
+  if(border > 1) {
+
+    // TODO: Work out why the first loop of border behaves differently when
+    // border > 1.
+    minBorder = 2;
+  }
+
+  // Judge every pixel against the map as it was on entry, so the result
+  // doesn't depend on scan order. A ring is empty when the square inside it
+  // holds as much as the square including it. Each ring then costs one
+  // lookup whatever its size, but a pixel whose rings are all occupied still
+  // takes border - minBorder + 1 of them.
+  static IntegralImage integral;
+  integral.build(featureBuffer);
+  if(width <= 2 * border || height <= 2 * border) {
+    return;
+  }
+
+  featureBuffer.forEachSet(border, border, width - border, height - border,
+                           [&](const unsigned int x, const unsigned int y) {
+    uint32_t inner = integral.sumAround(x, y, minBorder - 1);
+    for(unsigned int b = minBorder; b <= border; b++) {
+      const uint32_t outer = integral.sumAround(x, y, b);
+      if(outer == inner) {
+        featureBuffer.reset(x, y);
+        break;
+      }
+      inner = outer;
+    }
+  });
+}
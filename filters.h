@@ -13,6 +13,7 @@
 #include <map>
 
 #include "types.h"
+#include "featuremap.h"
 
 /* Blur an image to smooth the detail. */
 void blur(struct buffer<uint8_t>& inputBuffer,
@@ -21,47 +22,45 @@ void blur(struct buffer<uint8_t>& inputBuffer,
           const int gausKernelSize,
           const double gausSigma);
 
+/* Mean over a (2 * radius + 1) square window, repeated passes times. Each
+ * pass costs the same whatever the radius, and three or so passes come close
+ * to a Gaussian. Windows are clipped at the frame edges. */
+void boxBlur(struct buffer<uint8_t>& inputBuffer,
+             const int width,
+             const int height,
+             const int radius,
+             const int passes = 1);
+
+/* Box radius for which passes box blurs best match a Gaussian of sigma. */
+int boxRadiusForSigma(const double sigma, const int passes);
+
+/* Mark pixels whose colour changes across border pixels. If orientation is
+ * given it is sized to width * height and each feature pixel gets the angle
+ * of its gradient, i.e. of the normal of the edge it lies on, in whole
+ * degrees from a = -90 of the Hough transform (0 to HOUGH_ANGLES - 1).
+ * Other entries are left undefined. */
 void getFeatures(struct buffer<uint8_t>& inputBuffer,
-                 std::vector<uint8_t>& featureBuffer,
+                 FeatureMap& featureBuffer,
                  const unsigned int width,
                  const unsigned int height,
                  int thresholdColour,
                  int thresholdBrightness,
-                 int border);
+                 int border,
+                 struct buffer<uint8_t>* orientation = nullptr);
 
-void filterThin(std::vector<uint8_t>& featureBuffer, 
+void filterThin(FeatureMap& featureBuffer, 
                 const unsigned int width,
                 const unsigned int height,
                 const int trim,
                 int maxIterations);
 
 void merge(struct buffer<uint8_t>& finalBuffer,
-           std::vector<uint8_t>& featureBuffer,
+           const FeatureMap& featureBuffer,
            const unsigned int width,
            const unsigned int height);
 
-void filterSmallFeatures(std::vector<uint8_t>& featureBuffer,
+void filterSmallFeatures(FeatureMap& featureBuffer,
             const unsigned int width,
             const unsigned int height);
 
-void filterHough(std::vector<uint8_t>& inputBuffer,
-                 struct buffer<uint16_t>& outputBuffer,
-                 const unsigned int width,
-                 const unsigned int height);
-
-void dilateHough(struct buffer<uint16_t>& houghBuffer,
-                  const unsigned int width,
-                  const unsigned int height);
-
-size_t erodeHough(struct buffer<uint16_t>& houghBuffer,
-               const unsigned int width,
-               const unsigned int height,
-               const double threshold);
-
-void mergeHough(struct buffer<uint8_t>& finalBuffer,
-                struct buffer<uint16_t>& outputBuffer,
-                const unsigned int width,
-                const unsigned int height,
-                const double threshold);
-
 #endif  // WAZAT_FILTERS_H
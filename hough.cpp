@@ -0,0 +1,1107 @@
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#if defined(HOUGH_CHECK) || defined(HOUGH_BENCH)
+#include <iostream>
+#endif
+#ifdef HOUGH_BENCH
+#include <chrono>
+#endif
+
+#include "hough.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WAZAT_X86
+#endif
+
+#define HOUGH_TRIG_BITS 14
+
+/* r / rStep through pixel (x, y), rounded, for count columns starting with
+ * the one trig points at. count is a multiple of 8. */
+static void houghRadiiScalar(const int x, const int y, const int16_t* trig,
+                             int32_t* radii, const int count) {
+  for(int aOffset = 0; aOffset < count; aOffset++) {
+    radii[aOffset] = (x * trig[2 * aOffset] + y * trig[2 * aOffset + 1] +
+                      (1 << (HOUGH_TRIG_BITS - 1))) >> HOUGH_TRIG_BITS;
+  }
+}
+
+#ifdef WAZAT_X86
+
+__attribute__((target("sse2")))
+static void houghRadiiSse2(const int x, const int y, const int16_t* trig,
+                           int32_t* radii, const int count) {
+  const __m128i point = _mm_set1_epi32((y << 16) | (x & 0xffff));
+  const __m128i round = _mm_set1_epi32(1 << (HOUGH_TRIG_BITS - 1));
+  for(int aOffset = 0; aOffset < count; aOffset += 4) {
+    const __m128i sums = _mm_madd_epi16(
+        point, _mm_loadu_si128((const __m128i*)(trig + 2 * aOffset)));
+    _mm_storeu_si128((__m128i*)(radii + aOffset),
+                     _mm_srai_epi32(_mm_add_epi32(sums, round), HOUGH_TRIG_BITS));
+  }
+}
+
+__attribute__((target("avx2")))
+static void houghRadiiAvx2(const int x, const int y, const int16_t* trig,
+                           int32_t* radii, const int count) {
+  const __m256i point = _mm256_set1_epi32((y << 16) | (x & 0xffff));
+  const __m256i round = _mm256_set1_epi32(1 << (HOUGH_TRIG_BITS - 1));
+  for(int aOffset = 0; aOffset < count; aOffset += 8) {
+    const __m256i sums = _mm256_madd_epi16(
+        point, _mm256_loadu_si256((const __m256i*)(trig + 2 * aOffset)));
+    _mm256_storeu_si256((__m256i*)(radii + aOffset),
+                        _mm256_srai_epi32(_mm256_add_epi32(sums, round), HOUGH_TRIG_BITS));
+  }
+}
+
+#endif  // WAZAT_X86
+
+typedef void (*HoughRadiiFunction)(const int, const int, const int16_t*, int32_t*, const int);
+
+static HoughRadiiFunction pickHoughRadii() {
+#ifdef WAZAT_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) {
+    return houghRadiiAvx2;
+  }
+  return houghRadiiSse2;
+#endif
+  return houghRadiiScalar;
+}
+
+static const HoughRadiiFunction houghRadii = pickHoughRadii();
+
+void HoughTransform::configure(const unsigned int width_,
+                               const unsigned int height_,
+                               const double angleStep_,
+                               const double rStep_) {
+  const unsigned int columns_ =
+    std::max(1l, std::min((long)HOUGH_ANGLES * 16, lround(HOUGH_ANGLES / angleStep_)));
+  const double rStepClamped = std::max(1.0, rStep_);
+  if(width_ == width && height_ == height && columns_ == columns && rStepClamped == rStep) {
+    return;
+  }
+  // Coordinates go through 16 bit lanes.
+  assert(width_ <= 0x7fff && height_ <= 0x7fff);
+
+  width = width_;
+  height = height_;
+  columns = columns_;
+  angleStep = (double)HOUGH_ANGLES / columns;
+  rStep = rStepClamped;
+  // Rounding r / rStep can not reach rowOffset as houghMaxR() is at least
+  // one more than any |r|.
+  rowOffset = (int)ceil(houghMaxR(width, height) / rStep);
+  rows = 2 * rowOffset;
+
+  paddedColumns = (columns + 7) / 8 * 8 + 8;
+  trig.assign(2 * paddedColumns, 0);
+  for(unsigned int column_ = 0; column_ < columns; column_++) {
+    const double a = M_PI * angle(column_) / 180;
+    trig[2 * column_] = lround(cos(a) / rStep * (1 << HOUGH_TRIG_BITS));
+    trig[2 * column_ + 1] = lround(sin(a) / rStep * (1 << HOUGH_TRIG_BITS));
+  }
+
+  accumulator.resize((size_t)rows * columns);
+  accumulator.clear();
+  clearWindow();
+}
+
+void HoughTransform::setWindow(const double aMin, const double aMax,
+                               const double rMin, const double rMax) {
+  aBegin = std::max(0, (int)floor((aMin + HOUGH_ANGLES / 2) / angleStep));
+  aEnd = std::min((int)columns, (int)ceil((aMax + HOUGH_ANGLES / 2) / angleStep));
+  rBegin = std::max(0, (int)floor(rMin / rStep) + rowOffset);
+  rEnd = std::min(rows, (int)ceil(rMax / rStep) + rowOffset);
+}
+
+void HoughTransform::clearWindow() {
+  aBegin = 0;
+  aEnd = columns;
+  rBegin = 0;
+  rEnd = rows;
+}
+
+void HoughWorkers::stop() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    running = false;
+  }
+  changed.notify_all();
+  for(std::thread& thread : threads) {
+    thread.join();
+  }
+  threads.clear();
+  running = true;
+}
+
+void HoughWorkers::worker(const unsigned int index, uint64_t seen) {
+  std::unique_lock<std::mutex> guard(lock);
+  while(true) {
+    changed.wait(guard, [&]{ return !running || generation != seen; });
+    if(!running) {
+      return;
+    }
+    seen = generation;
+    guard.unlock();
+    job(index);
+    guard.lock();
+    if(--pending == 0) {
+      changed.notify_all();
+    }
+  }
+}
+
+void HoughWorkers::run(const unsigned int count,
+                       const std::function<void(unsigned int)>& job_) {
+  if(threads.size() + 1 != count) {
+    stop();
+    for(unsigned int index = 1; index < count; index++) {
+      threads.push_back(std::thread(&HoughWorkers::worker, this, index, generation));
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    job = job_;
+    pending = threads.size();
+    generation++;
+  }
+  changed.notify_all();
+  job_(0);
+
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [this]{ return pending == 0; });
+}
+
+/* Vote set pixels into the cells of columns [columnBegin, columnEnd) and
+ * rows [rowBegin, rowEnd). origin is the cell of row 0 and column
+ * columnBegin, and rows are rowStride cells apart. Counting set pixels from
+ * 0 in raster order, only those whose count is phase modulo stride vote. */
+void HoughTransform::voteColumns(const FeatureMap& features,
+                                 uint16_t* origin, const int rowStride,
+                                 const int columnBegin, const int columnEnd,
+                                 const int rowBegin, const int rowEnd,
+                                 const unsigned int stride, const unsigned int phase) {
+  if(columnBegin >= columnEnd || rowBegin >= rowEnd) {
+    return;
+  }
+  const int16_t* trig_ = trig.data() + 2 * columnBegin;
+  const int count = (columnEnd - columnBegin + 7) / 8 * 8;
+  std::vector<int32_t> radii(count);
+  // Every r lands in some row, so only a real r window needs checking.
+  const bool whole = rowBegin == 0 && rowEnd == rows;
+
+  // The 10 pixel margin matches the rest of the pipeline. Whole empty words
+  // of the map are skipped.
+  unsigned int skip = phase;
+  features.forEachSet(10, 10, width - 10, height - 10,
+                      [&](const unsigned int x, const unsigned int y) {
+    if(skip) {
+      skip--;
+      return;
+    }
+    skip = stride - 1;
+    houghRadii(x, y, trig_, radii.data(), count);
+    if(whole) {
+      for(int column_ = 0; column_ < columnEnd - columnBegin; column_++) {
+        uint16_t* value = origin + (radii[column_] + rowOffset) * rowStride + column_;
+        *value += *value < 0xffff -1;
+      }
+      return;
+    }
+    for(int column_ = 0; column_ < columnEnd - columnBegin; column_++) {
+      const int row_ = radii[column_] + rowOffset;
+      if(row_ < rowBegin || row_ >= rowEnd) {
+        continue;
+      }
+      uint16_t* value = origin + row_ * rowStride + column_;
+      *value += *value < 0xffff -1;
+    }
+  });
+}
+
+void HoughTransform::vote(const FeatureMap& features, unsigned int threads) {
+#ifdef HOUGH_BENCH
+  // Build with -DHOUGH_BENCH to time the first frame at every thread count
+  // up to one per core, to choose the threads default from.
+  static bool timed = false;
+  if(!timed) {
+    timed = true;
+    const unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    for(unsigned int count = 1; count <= cores; count++) {
+      const auto start = std::chrono::steady_clock::now();
+      for(int repeat = 0; repeat < 20; repeat++) {
+        accumulator.clear();
+        voteThreaded(features, count, 1, 0);
+      }
+      const std::chrono::duration<double, std::milli> taken =
+        std::chrono::steady_clock::now() - start;
+      std::cout << "Hough vote on " << count << " threads: " << taken.count() / 20 <<
+                   "ms" << std::endl;
+    }
+  }
+#endif
+  accumulator.clear();
+  voteThreaded(features, threads, 1, 0);
+}
+
+void HoughTransform::voteThreaded(const FeatureMap& features, unsigned int threads,
+                                  const unsigned int stride, const unsigned int phase) {
+  // Threads split the columns in blocks of 8. Each votes every pixel into
+  // a tile of its own columns and then adds the tile in. No cell has two
+  // writers and each still gets the same votes, so the result is exactly
+  // the serial one.
+  const unsigned int blocks = (aEnd - aBegin + 7) / 8;
+  if(threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads = std::min(threads, std::max(1u, blocks));
+  if(threads == 1) {
+    voteColumns(features, accumulator.start + aBegin, columns, aBegin, aEnd,
+                rBegin, rEnd, stride, phase);
+    return;
+  }
+
+  tiles.resize(threads);
+  workers.run(threads, [&](const unsigned int index) {
+    const int columnBegin = aBegin + 8 * (index * blocks / threads);
+    const int columnEnd = std::min(aBegin + 8 * (int)((index + 1) * blocks / threads), aEnd);
+    const int span = columnEnd - columnBegin;
+    if(span <= 0) {
+      return;
+    }
+    struct buffer<uint16_t>& tile = tiles[index];
+    tile.resize((size_t)rows * span);
+    memset(tile.start + rBegin * span, 0, (size_t)(rEnd - rBegin) * span * sizeof(uint16_t));
+    voteColumns(features, tile.start, span, columnBegin, columnEnd, rBegin, rEnd,
+                stride, phase);
+
+    // Add the tile in once voting is done, saturating like a vote. Only the
+    // ends of each row can share a cache line with another thread's.
+    for(int row_ = rBegin; row_ < rEnd; row_++) {
+      const uint16_t* votes = tile.start + row_ * span;
+      uint16_t* cells = accumulator.start + row_ * columns + columnBegin;
+      for(int column_ = 0; column_ < span; column_++) {
+        cells[column_] = std::min(cells[column_] + votes[column_], 0xffff - 1);
+      }
+    }
+  });
+}
+
+void HoughTransform::voteDecayed(const FeatureMap& features,
+                                 const double decay,
+                                 const unsigned int stride,
+                                 const unsigned int threads) {
+  // Q8, truncating so a cell no pixel votes for reaches 0.
+  const uint32_t factor = lround(std::max(0.0, std::min(1.0, decay)) * 256);
+  uint16_t* value = accumulator.start;
+  uint16_t* const end = accumulator.start + accumulator.length;
+  for(; value < end; value++) {
+    *value = (*value * factor) >> 8;
+  }
+
+  const unsigned int stride_ = std::max(1u, stride);
+  decayPhase = (decayPhase + 1) % stride_;
+  voteThreaded(features, threads, stride_, decayPhase);
+}
+
+void HoughTransform::voteOriented(const FeatureMap& features,
+                                  const struct buffer<uint8_t>& orientation,
+                                  const double window) {
+  assert(orientation.length >= (size_t)width * height);
+  accumulator.clear();
+  const int reach = (int)ceil(window / angleStep);
+  const int span = std::min(2 * reach + 1, (int)columns);
+  const int columns_ = columns;
+
+  // Columns wrap round from the last to the first, which is fine because
+  // each column works out its own r.
+  features.forEachSet(10, 10, width - 10, height - 10,
+                      [&](const unsigned int x, const unsigned int y) {
+    // orientation is in whole degrees from a = -90.
+    int column_ = (int)lround(orientation.start[y * width + x] / angleStep) - span / 2;
+    column_ = ((column_ % columns_) + columns_) % columns_;
+    for(int step = 0; step < span; step++) {
+      if(column_ >= aBegin && column_ < aEnd) {
+        const int16_t* trig_ = trig.data() + 2 * column_;
+        const int row_ = (((int)x * trig_[0] + (int)y * trig_[1] +
+                           (1 << (HOUGH_TRIG_BITS - 1))) >> HOUGH_TRIG_BITS) + rowOffset;
+        if(row_ >= rBegin && row_ < rEnd) {
+          uint16_t* value = accumulator.start + row_ * columns_ + column_;
+          *value += *value < 0xffff -1;
+        }
+      }
+      if(++column_ == columns_) {
+        column_ = 0;
+      }
+    }
+  });
+}
+
+/* More votes first. Ties go to the cell first in memory, so which peaks are
+ * kept doesn't depend on the order cells were scanned in. */
+static bool strongerPeak(const struct HoughPeak& lhs, const struct HoughPeak& rhs) {
+  if(lhs.votes != rhs.votes) {
+    return lhs.votes > rhs.votes;
+  }
+  return lhs.r < rhs.r || (lhs.r == rhs.r && lhs.a < rhs.a);
+}
+
+/* Add the peaks among rows [rowBegin, rowEnd) and columns
+ * [columnBegin, columnEnd) to the min heap of the strongest maxPeaks. */
+void HoughTransform::scanPeaks(std::vector<struct HoughPeak>& peaks,
+                               const unsigned int threshold,
+                               const int neighbourhood,
+                               const size_t maxPeaks,
+                               const int columnBegin, const int columnEnd,
+                               const int rowBegin, const int rowEnd) const {
+  const int columns_ = columns;
+
+  // Index of (row_, column_), following the angle round past either end
+  // with r negated, or -1 off the accumulator.
+  auto cell = [&](int row_, int column_) -> long {
+    if(column_ < 0 || column_ >= columns_) {
+      column_ += column_ < 0 ? columns_ : -columns_;
+      row_ = 2 * rowOffset - row_;
+    }
+    if(row_ < 0 || row_ >= rows) {
+      return -1;
+    }
+    return (long)row_ * columns_ + column_;
+  };
+
+  for(int row_ = std::max(rowBegin, 0); row_ < std::min(rowEnd, rows); row_++) {
+    const uint16_t* cells = accumulator.start + row_ * columns_;
+    for(int column_ = std::max(columnBegin, 0); column_ < std::min(columnEnd, columns_); column_++) {
+      const unsigned int votes = cells[column_];
+      if(votes < threshold ||
+         (peaks.size() == maxPeaks && votes < peaks.front().votes)) {
+        continue;
+      }
+      // A plateau keeps only its first cell in memory order, which unlike
+      // the offsets still holds across the wrap.
+      const long index = (long)row_ * columns_ + column_;
+      bool peak = true;
+      for(int dr = -neighbourhood; dr <= neighbourhood && peak; dr++) {
+        for(int da = -neighbourhood; da <= neighbourhood; da++) {
+          const long neighbour = cell(row_ + dr, column_ + da);
+          if(neighbour < 0) {
+            continue;
+          }
+          const unsigned int other = accumulator.start[neighbour];
+          if(other > votes || (other == votes && neighbour < index)) {
+            peak = false;
+            break;
+          }
+        }
+      }
+      if(!peak) {
+        continue;
+      }
+      const struct HoughPeak found = {radius(row_), angle(column_), votes};
+      if(peaks.size() == maxPeaks) {
+        if(!strongerPeak(found, peaks.front())) {
+          continue;
+        }
+        std::pop_heap(peaks.begin(), peaks.end(), strongerPeak);
+        peaks.pop_back();
+      }
+      peaks.push_back(found);
+      std::push_heap(peaks.begin(), peaks.end(), strongerPeak);
+    }
+  }
+}
+
+/* Sort the heap strongest first and drop the near duplicates. */
+size_t HoughTransform::sortPeaks(std::vector<struct HoughPeak>& peaks,
+                                 const int mergeDistance) const {
+  std::sort_heap(peaks.begin(), peaks.end(), strongerPeak);
+
+  // Each peak is only checked against stronger ones. A line at a - 180 is
+  // the same one with r negated. Peaks found twice are always dropped.
+  const double aDistance = mergeDistance * angleStep + 1e-6;
+  const double rDistance = mergeDistance * rStep + 1e-6;
+  size_t kept = 0;
+  for(size_t index = 0; index < peaks.size(); index++) {
+    bool duplicate = false;
+    for(size_t previous = 0; previous < kept && !duplicate; previous++) {
+      const double da = fabs(peaks[previous].a - peaks[index].a);
+      duplicate = (da <= aDistance && fabs(peaks[previous].r - peaks[index].r) <= rDistance) ||
+                  (HOUGH_ANGLES - da <= aDistance &&
+                   fabs(peaks[previous].r + peaks[index].r) <= rDistance);
+    }
+    if(!duplicate) {
+      peaks[kept++] = peaks[index];
+    }
+  }
+  peaks.resize(kept);
+  return kept;
+}
+
+size_t HoughTransform::findPeaks(std::vector<struct HoughPeak>& peaks,
+                                 const unsigned int threshold,
+                                 const int neighbourhood,
+                                 const size_t maxPeaks,
+                                 const int mergeDistance) const {
+  peaks.clear();
+  if(accumulator.length == 0 || maxPeaks == 0) {
+    return 0;
+  }
+  scanPeaks(peaks, threshold, neighbourhood, maxPeaks, 0, columns, 0, rows);
+  return sortPeaks(peaks, mergeDistance);
+}
+
+void HoughTransform::voteTargets(const FeatureMap& features, const int reachA, const int reachR) {
+  // Where the windows of two targets overlap a pixel still votes each
+  // column only once.
+  const int columns_ = columns;
+  refineStamps.assign(columns, 0);
+  uint32_t stamp = 0;
+
+  accumulator.clear();
+  features.forEachSet(10, 10, width - 10, height - 10,
+                      [&](const unsigned int x, const unsigned int y) {
+    stamp++;
+    for(const struct HoughRefine& target : refineTargets) {
+      const int gateRow = ((int)x * target.gateTrig[0] + (int)y * target.gateTrig[1] +
+                           (1 << (HOUGH_TRIG_BITS - 1))) >> HOUGH_TRIG_BITS;
+      if(abs(gateRow - target.gateRow) > target.gateReach) {
+        continue;
+      }
+      for(int column_ = target.column - reachA; column_ <= target.column + reachA; column_++) {
+        int wrapped = column_;
+        int centre = target.row;
+        if(wrapped < 0 || wrapped >= columns_) {
+          wrapped += wrapped < 0 ? columns_ : -columns_;
+          centre = 2 * rowOffset - target.row;
+        }
+        if(wrapped < aBegin || wrapped >= aEnd || refineStamps[wrapped] == stamp) {
+          continue;
+        }
+        const int16_t* trig_ = trig.data() + 2 * wrapped;
+        const int row_ = (((int)x * trig_[0] + (int)y * trig_[1] +
+                           (1 << (HOUGH_TRIG_BITS - 1))) >> HOUGH_TRIG_BITS) + rowOffset;
+        if(abs(row_ - centre) > reachR || row_ < rBegin || row_ >= rEnd) {
+          continue;
+        }
+        refineStamps[wrapped] = stamp;
+        uint16_t* value = accumulator.start + row_ * columns_ + wrapped;
+        *value += *value < 0xffff -1;
+      }
+    }
+  });
+}
+
+void HoughTransform::voteAround(const FeatureMap& features,
+                                const std::vector<struct HoughPeak>& around,
+                                const double aReach,
+                                const double rReach,
+                                const int margin) {
+  const int reachA = (int)ceil(aReach / angleStep);
+  const int reachR = (int)ceil(rReach / rStep);
+  const int voteA = reachA + margin;
+  const int voteR = reachR + margin;
+  // r at a + da differs from r at a by up to houghMaxR() * sin(da), so a
+  // pixel further than that from the line at a can not reach the window.
+  const double spanA = std::min(voteA * angleStep, 90.0);
+  const int gateReach = voteR +
+    (int)ceil(houghMaxR(width, height) * sin(M_PI * spanA / 180) / rStep);
+  const int columns_ = columns;
+
+  refineTargets.clear();
+  for(const struct HoughPeak& line : around) {
+    int column_ = column(line.a);
+    int row_ = row(line.r);
+    if(column_ < 0 || column_ >= columns_) {
+      column_ += column_ < 0 ? columns_ : -columns_;
+      row_ = 2 * rowOffset - row_;
+    }
+    refineTargets.push_back({trig.data() + 2 * column_, row_ - rowOffset, gateReach,
+                             column_, row_});
+  }
+  voteTargets(features, voteA, voteR);
+  refineReachA = reachA;
+  refineReachR = reachR;
+}
+
+size_t HoughTransform::findPeaksAround(std::vector<struct HoughPeak>& peaks,
+                                       const unsigned int threshold,
+                                       const int neighbourhood,
+                                       const size_t maxPeaks,
+                                       const int mergeDistance) const {
+  // Only the windows can hold votes, so only they are searched.
+  peaks.clear();
+  if(accumulator.length == 0 || maxPeaks == 0) {
+    return 0;
+  }
+  const int columns_ = columns;
+  const int reachA = refineReachA;
+  const int reachR = refineReachR;
+
+  // Windows can overlap, and a cell scanned twice would take two places in
+  // the heap. So each column's row ranges are merged first.
+  struct Span {
+    int column;
+    int rowBegin;
+    int rowEnd;
+  };
+  std::vector<struct Span> spans;
+  for(const struct HoughRefine& target : refineTargets) {
+    const int mirror = 2 * rowOffset - target.row;
+    for(int column_ = target.column - reachA; column_ <= target.column + reachA; column_++) {
+      if(column_ < 0) {
+        spans.push_back({column_ + columns_, mirror - reachR, mirror + reachR + 1});
+      } else if(column_ >= columns_) {
+        spans.push_back({column_ - columns_, mirror - reachR, mirror + reachR + 1});
+      } else {
+        spans.push_back({column_, target.row - reachR, target.row + reachR + 1});
+      }
+    }
+  }
+  std::sort(spans.begin(), spans.end(), [](const struct Span& lhs, const struct Span& rhs) {
+    return lhs.column < rhs.column || (lhs.column == rhs.column && lhs.rowBegin < rhs.rowBegin);
+  });
+  for(size_t index = 0; index < spans.size();) {
+    const int column_ = spans[index].column;
+    const int rowBegin = spans[index].rowBegin;
+    int rowEnd = spans[index].rowEnd;
+    for(index++; index < spans.size() && spans[index].column == column_ &&
+                 spans[index].rowBegin <= rowEnd; index++) {
+      rowEnd = std::max(rowEnd, spans[index].rowEnd);
+    }
+    scanPeaks(peaks, threshold, neighbourhood, maxPeaks, column_, column_ + 1, rowBegin, rowEnd);
+  }
+  return sortPeaks(peaks, mergeDistance);
+}
+
+size_t HoughTransform::findPeaksCoarseToFine(const FeatureMap& features,
+                                             std::vector<struct HoughPeak>& peaks,
+                                             const unsigned int factor,
+                                             const unsigned int threshold,
+                                             const int neighbourhood,
+                                             const size_t maxPeaks,
+                                             const int mergeDistance,
+                                             const unsigned int threads) {
+  if(!coarse) {
+    coarse.reset(new HoughTransform);
+  }
+  coarse->configure(width, height, angleStep * factor, rStep * factor);
+  coarse->setWindow(angle(aBegin), angle(aEnd), radius(rBegin), radius(rEnd));
+  coarse->vote(features, threads);
+  // A coarse cell collects about the votes of all the fine cells inside it,
+  // so the fine threshold does for it too.
+  coarse->findPeaks(coarsePeaks, threshold, 1, maxPeaks, 0);
+
+  // The line of a coarse peak can be up to a coarse cell off in angle. Its
+  // pixels then spread over r by up to houghMaxR() * sin(angleStep) at the
+  // coarse angle, so the coarse peak's r can be that far off too, on top of
+  // the coarse cell itself.
+  const double spread = houghMaxR(width, height) * sin(M_PI * coarse->angleStep / 180);
+  // The margin makes the cells round the edges of the windows, which peaks
+  // there are compared with, the same as the full transform's.
+  voteAround(features, coarsePeaks, coarse->angleStep, coarse->rStep + spread, neighbourhood);
+  findPeaksAround(peaks, threshold, neighbourhood, maxPeaks, mergeDistance);
+
+#ifdef HOUGH_CHECK
+  // Build with -DHOUGH_CHECK to compare every frame with the full transform.
+  static HoughTransform full;
+  static std::vector<struct HoughPeak> fullPeaks;
+  full.configure(width, height, angleStep, rStep);
+  full.setWindow(angle(aBegin), angle(aEnd), radius(rBegin), radius(rEnd));
+  full.vote(features, threads);
+  full.findPeaks(fullPeaks, threshold, neighbourhood, maxPeaks, mergeDistance);
+  bool same = fullPeaks.size() == peaks.size();
+  for(size_t index = 0; same && index < peaks.size(); index++) {
+    same = fullPeaks[index].r == peaks[index].r && fullPeaks[index].a == peaks[index].a &&
+           fullPeaks[index].votes == peaks[index].votes;
+  }
+  if(!same) {
+    std::cout << "Coarse to fine found " << peaks.size() << " peaks, the full transform " <<
+                 fullPeaks.size() << std::endl;
+  }
+#endif
+  return peaks.size();
+}
+
+/* Step along the line at a degrees from (x, y), one pixel at a time in
+ * whichever of x or y changes faster, in direction sign. Calls
+ * visit(x, y, across) for each pixel inside the frame, starting with (x, y)
+ * itself, until visit returns false or the frame edge is reached. visit may
+ * set across, initially 0, to move the rest of the walk that many pixels
+ * along the other axis. */
+template <class Visit>
+static void walkLine(const int x, const int y, const double a, const int sign,
+                     const unsigned int width, const unsigned int height, Visit visit) {
+  const int shift = 16;
+  const double angle = M_PI * a / 180;
+  // Along the line, at right angles to its normal.
+  const double dx = -sin(angle) * sign;
+  const double dy = cos(angle) * sign;
+  // Decided here rather than from the steps, which are equal at 45 degrees.
+  const bool majorX = fabs(dx) > fabs(dy);
+  int64_t stepX;
+  int64_t stepY;
+  if(majorX) {
+    stepX = (dx > 0 ? 1 : -1) * ((int64_t)1 << shift);
+    stepY = llround(dy / fabs(dx) * (1 << shift));
+  } else {
+    stepY = (dy > 0 ? 1 : -1) * ((int64_t)1 << shift);
+    stepX = llround(dx / fabs(dy) * (1 << shift));
+  }
+
+  int64_t fixedX = ((int64_t)x << shift) + (1 << (shift - 1));
+  int64_t fixedY = ((int64_t)y << shift) + (1 << (shift - 1));
+  while(true) {
+    const int64_t px = fixedX >> shift;
+    const int64_t py = fixedY >> shift;
+    if(px < 0 || py < 0 || px >= (int64_t)width || py >= (int64_t)height) {
+      return;
+    }
+    int across = 0;
+    if(!visit((int)px, (int)py, across)) {
+      return;
+    }
+    if(majorX) {
+      fixedY += (int64_t)across << shift;
+    } else {
+      fixedX += (int64_t)across << shift;
+    }
+    fixedX += stepX;
+    fixedY += stepY;
+  }
+}
+
+size_t HoughTransform::findSegmentsProbabilistic(const FeatureMap& features,
+                                                 std::vector<struct LineSegment>& segments,
+                                                 const unsigned int threshold,
+                                                 const unsigned int minLength,
+                                                 const unsigned int maxGap,
+                                                 const size_t maxLines,
+                                                 const size_t budget) {
+  const int16_t* trig_ = trig.data();
+  const int columns_ = columns;
+
+  segments.clear();
+  accumulator.clear();
+  uint16_t* origin = accumulator.start + rowOffset * columns_;
+  unclaimed = features;
+  voted.resize(width, height);
+
+  // Same margin as vote().
+  pending.clear();
+  features.forEachSet(10, 10, width - 10, height - 10,
+                         [&](const unsigned int x, const unsigned int y) {
+    pending.push_back({(uint16_t)x, (uint16_t)y});
+  });
+
+  const int count = (columns_ + 7) / 8 * 8;
+  std::vector<int32_t> radii(count);
+  std::vector<int32_t> unvote(count);
+  // A fixed seed, so a given frame always gives the same lines.
+  uint64_t random = 0x9e3779b97f4a7c15ull;
+  size_t votes = 0;
+  while(!pending.empty() && votes < budget && segments.size() < maxLines) {
+    // Draw a pixel at random without replacement. xorshift64.
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    const size_t pick = random % pending.size();
+    const HoughPixel pixel = pending[pick];
+    pending[pick] = pending.back();
+    pending.pop_back();
+    if(!unclaimed.get(pixel.x, pixel.y)) {
+      continue;
+    }
+
+    houghRadii(pixel.x, pixel.y, trig_, radii.data(), count);
+    voted.set(pixel.x, pixel.y);
+    votes++;
+    unsigned int best = 0;
+    int bestColumn = 0;
+    for(int column_ = 0; column_ < columns_; column_++) {
+      uint16_t* value = origin + radii[column_] * columns_ + column_;
+      *value += *value < 0xffff -1;
+      if(*value > best) {
+        best = *value;
+        bestColumn = column_;
+      }
+    }
+    if(best < threshold) {
+      continue;
+    }
+
+    // A pixel of the line counts if an unclaimed feature is within a pixel
+    // of it across the line, as in extractSegments(). The walk moves over to
+    // a feature found off the line, so it follows the line itself rather
+    // than drifting off it at the angle of the cell.
+    const double bestAngle = angle(bestColumn);
+    const bool acrossY = fabs(sin(M_PI * bestAngle / 180)) > fabs(cos(M_PI * bestAngle / 180));
+    auto feature = [&](const int x, const int y, const int offset) {
+      const unsigned int nearX = acrossY ? x : x + offset;
+      const unsigned int nearY = acrossY ? y + offset : y;
+      return nearX < width && nearY < height && unclaimed.get(nearX, nearY);
+    };
+
+    // Follow the line each way until the gap gets too long.
+    int ends[2][2];
+    size_t end[2] = {1, 1};
+    for(int side = 0; side < 2; side++) {
+      unsigned int gap = 0;
+      ends[side][0] = pixel.x;
+      ends[side][1] = pixel.y;
+      path[side].clear();
+      walkLine(pixel.x, pixel.y, bestAngle, side ? -1 : 1, width, height,
+               [&](const int x, const int y, int& across) {
+        path[side].push_back({(uint16_t)x, (uint16_t)y});
+        if(feature(x, y, 0) || feature(x, y, -1) || feature(x, y, 1)) {
+          if(!feature(x, y, 0)) {
+            across = feature(x, y, -1) ? -1 : 1;
+          }
+          gap = 0;
+          ends[side][0] = x;
+          ends[side][1] = y;
+          end[side] = path[side].size();
+        } else if(++gap > maxGap) {
+          return false;
+        }
+        return true;
+      });
+    }
+    const bool good = (unsigned int)std::max(abs(ends[1][0] - ends[0][0]),
+                                             abs(ends[1][1] - ends[0][1])) >= minLength;
+
+    // Claim the pixels along the same path, withdrawing their votes if it is
+    // kept. Both sides start on the drawn pixel, so the second skips it: the
+    // first has claimed it, and a feature beside it was never followed.
+    unsigned int gaps = 0;
+    for(int side = 0; side < 2; side++) {
+      for(size_t step = side; step < end[side]; step++) {
+        const int x = path[side][step].x;
+        const int y = path[side][step].y;
+        // Only the feature the walk followed, so lines crossing at a
+        // shallow angle keep theirs.
+        bool found = false;
+        for(const int offset : {0, -1, 1}) {
+          if(found || !feature(x, y, offset)) {
+            continue;
+          }
+          const unsigned int nearX = acrossY ? x : x + offset;
+          const unsigned int nearY = acrossY ? y + offset : y;
+          if(good && voted.get(nearX, nearY)) {
+            houghRadii(nearX, nearY, trig_, unvote.data(), count);
+            for(int column_ = 0; column_ < columns_; column_++) {
+              uint16_t* value = origin + unvote[column_] * columns_ + column_;
+              *value -= *value > 0;
+            }
+          }
+          unclaimed.reset(nearX, nearY);
+          found = true;
+        }
+        gaps += !found;
+      }
+    }
+
+    if(good) {
+      struct LineSegment segment;
+      segment.x0 = ends[0][0];
+      segment.y0 = ends[0][1];
+      segment.x1 = ends[1][0];
+      segment.y1 = ends[1][1];
+      segment.line.r = lround(radius(radii[bestColumn] + rowOffset));
+      segment.line.a = lround(bestAngle);
+      segment.votes = best;
+      segment.gaps = gaps;
+      segments.push_back(segment);
+    }
+  }
+
+  return votes;
+}
+
+/* numerator / denominator rounded to nearest. */
+static int roundedDivide(const int64_t numerator, const int64_t denominator) {
+  // Division truncates, so push the numerator half a step away from zero.
+  const int64_t half = llabs(denominator) / 2;
+  return (numerator + (numerator < 0 ? -half : half)) / denominator;
+}
+
+/* Clip the segment from (x0, y0) to (x1, y1) to the frame (Cohen and
+ * Sutherland). New ends are rounded to the nearest pixel. Returns false if
+ * none of it is inside. */
+static bool clipSegment(int& x0, int& y0, int& x1, int& y1,
+                        const unsigned int width, const unsigned int height) {
+  const int right = (int)width - 1;
+  const int bottom = (int)height - 1;
+  auto outcode = [&](const int x, const int y) {
+    return (x < 0) | (x > right) << 1 | (y < 0) << 2 | (y > bottom) << 3;
+  };
+  int code0 = outcode(x0, y0);
+  int code1 = outcode(x1, y1);
+  while(code0 | code1) {
+    if(code0 & code1) {
+      return false;
+    }
+    // Move whichever end is outside onto the edge it is beyond.
+    const int code = code0 ? code0 : code1;
+    const int64_t dx = x1 - x0;
+    const int64_t dy = y1 - y0;
+    int x;
+    int y;
+    if(code & 1) {
+      x = 0;
+      y = y0 + roundedDivide(dy * (0 - x0), dx);
+    } else if(code & 2) {
+      x = right;
+      y = y0 + roundedDivide(dy * (right - x0), dx);
+    } else if(code & 4) {
+      y = 0;
+      x = x0 + roundedDivide(dx * (0 - y0), dy);
+    } else {
+      y = bottom;
+      x = x0 + roundedDivide(dx * (bottom - y0), dy);
+    }
+    if(code == code0) {
+      x0 = x;
+      y0 = y;
+      code0 = outcode(x0, y0);
+    } else {
+      x1 = x;
+      y1 = y;
+      code1 = outcode(x1, y1);
+    }
+  }
+  return true;
+}
+
+/* Bresenham from (x0, y0) to (x1, y1) inclusive. Calls visit(x, y) for each
+ * pixel until visit returns false. */
+template <class Visit>
+static void rasterise(int x0, int y0, const int x1, const int y1, Visit visit) {
+  const int dx = abs(x1 - x0);
+  const int dy = -abs(y1 - y0);
+  const int stepX = x0 < x1 ? 1 : -1;
+  const int stepY = y0 < y1 ? 1 : -1;
+  int error = dx + dy;
+  while(visit(x0, y0) && (x0 != x1 || y0 != y1)) {
+    const int twice = 2 * error;
+    if(twice >= dy) {
+      error += dy;
+      x0 += stepX;
+    }
+    if(twice <= dx) {
+      error += dx;
+      y0 += stepY;
+    }
+  }
+}
+
+/* Where the line of peak crosses the frame edges. Returns false if it
+ * misses the frame. */
+static bool peakEnds(const struct HoughPeak& peak,
+                     const unsigned int width,
+                     const unsigned int height,
+                     int ends[4]) {
+  const double a = M_PI * peak.a / 180;
+  const double length = houghMaxR(width, height);
+  // The foot of the normal from the origin, then either way along the line.
+  const double x = peak.r * cos(a);
+  const double y = peak.r * sin(a);
+  ends[0] = lround(x + length * sin(a));
+  ends[1] = lround(y - length * cos(a));
+  ends[2] = lround(x - length * sin(a));
+  ends[3] = lround(y + length * cos(a));
+  return clipSegment(ends[0], ends[1], ends[2], ends[3], width, height);
+}
+
+#ifdef HOUGH_CHECK
+/* Draw segments at random, each on its own, and find them again from the
+ * strongest peak of the full transform. Reports how many don't come back
+ * as one segment with both ends within a pixel of where they were drawn. */
+static void checkSegmentEnds() {
+  const unsigned int width = 640;
+  const unsigned int height = 480;
+  const int trials = 200;
+  HoughTransform transform;
+  transform.configure(width, height);
+  FeatureMap features;
+  std::vector<struct HoughPeak> peaks;
+  std::vector<struct LineSegment> found;
+  uint64_t random = 0x9e3779b97f4a7c15ull;
+  auto next = [&](const unsigned int range) {
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    return (int)(random % range);
+  };
+  auto close = [](const int x, const int y, const int x_, const int y_) {
+    return abs(x - x_) <= 1 && abs(y - y_) <= 1;
+  };
+
+  int wrong = 0;
+  for(int trial = 0; trial < trials; trial++) {
+    // Inside the margin vote() leaves out, and long enough to be a clear peak.
+    int ends[4];
+    do {
+      ends[0] = 10 + next(width - 20);
+      ends[1] = 10 + next(height - 20);
+      ends[2] = 10 + next(width - 20);
+      ends[3] = 10 + next(height - 20);
+    } while(std::max(abs(ends[2] - ends[0]), abs(ends[3] - ends[1])) < 60);
+    features.resize(width, height);
+    rasterise(ends[0], ends[1], ends[2], ends[3], [&](const int x, const int y) {
+      features.set(x, y);
+      return true;
+    });
+    transform.vote(features);
+    transform.findPeaks(peaks, 30, 2, 1, 0);
+    extractSegments(features, peaks, found, width, height, 30, 5, 1,
+                    transform.angleStep);
+    const bool same = found.size() == 1 &&
+      ((close(found[0].x0, found[0].y0, ends[0], ends[1]) &&
+        close(found[0].x1, found[0].y1, ends[2], ends[3])) ||
+       (close(found[0].x0, found[0].y0, ends[2], ends[3]) &&
+        close(found[0].x1, found[0].y1, ends[0], ends[1])));
+    wrong += !same;
+  }
+  std::cout << "Segment ends wrong for " << wrong << " of " << trials <<
+               " drawn segments" << std::endl;
+}
+#endif
+
+size_t extractSegments(const FeatureMap& inputBuffer,
+                       const std::vector<struct HoughPeak>& peaks,
+                       std::vector<struct LineSegment>& segments,
+                       const unsigned int width,
+                       const unsigned int height,
+                       const unsigned int minLength,
+                       const unsigned int maxGap,
+                       const int tolerance,
+                       const double angleStep) {
+#ifdef HOUGH_CHECK
+  // Build with -DHOUGH_CHECK to check the ends of drawn segments once.
+  static bool checked = false;
+  if(!checked) {
+    checked = true;
+    checkSegmentEnds();
+  }
+#endif
+  segments.clear();
+  for(const struct HoughPeak& peak : peaks) {
+    int ends[4];
+    if(!peakEnds(peak, width, height, ends)) {
+      continue;
+    }
+    // Look up to tolerance pixels either side across the line's minor axis,
+    // nearest first, and give the offset of the feature found.
+    const double a = M_PI * peak.a / 180;
+    const bool acrossY = fabs(sin(a)) > fabs(cos(a));
+    // Until the walk is on a segment it may be off the line in the image by
+    // as much as the cell's half angle turns over half the frame.
+    const double span = hypot(ends[2] - ends[0], ends[3] - ends[1]);
+    const int reach = tolerance + (int)ceil(span / 2 * sin(M_PI * angleStep / 360));
+    auto near = [&](const int x, const int y, const int limit, int& offset) {
+      for(int distance = 0; distance <= limit; distance++) {
+        for(const int side : {-1, 1}) {
+          offset = side * distance;
+          const unsigned int nearX = acrossY ? x : x + offset;
+          const unsigned int nearY = acrossY ? y + offset : y;
+          if(nearX < width && nearY < height && inputBuffer.get(nearX, nearY)) {
+            return true;
+          }
+        }
+      }
+      return false;
+    };
+
+    struct LineSegment segment;
+    segment.line.r = lround(peak.r);
+    segment.line.a = lround(peak.a);
+    segment.votes = peak.votes;
+    bool inside = false;
+    unsigned int gap = 0;
+    auto finish = [&]() {
+      if((unsigned int)std::max(abs(segment.x1 - segment.x0),
+                                abs(segment.y1 - segment.y0)) >= minLength) {
+        segments.push_back(segment);
+      }
+      inside = false;
+      gap = 0;
+    };
+    // Walk from one edge of the frame to the other. As in
+    // findSegmentsProbabilistic(), the walk moves over to each feature it
+    // finds off the line, so it follows the line in the image rather than
+    // the line of the cell, which can be half a cell off in angle.
+    const int sign = -(ends[2] - ends[0]) * sin(a) + (ends[3] - ends[1]) * cos(a) >= 0 ? 1 : -1;
+    walkLine(ends[0], ends[1], peak.a, sign, width, height,
+             [&](const int x, const int y, int& across) {
+      int offset;
+      if(near(x, y, inside ? tolerance : reach, offset)) {
+        across = offset;
+        const int featureX = acrossY ? x : x + offset;
+        const int featureY = acrossY ? y + offset : y;
+        if(!inside) {
+          inside = true;
+          segment.x0 = featureX;
+          segment.y0 = featureY;
+          segment.gaps = 0;
+        }
+        segment.gaps += gap;
+        gap = 0;
+        segment.x1 = featureX;
+        segment.y1 = featureY;
+      } else if(inside && ++gap > maxGap) {
+        finish();
+      }
+      return true;
+    });
+    if(inside) {
+      finish();
+    }
+  }
+  return segments.size();
+}
+
+static void plot(struct buffer<uint8_t>& finalBuffer, const unsigned int width,
+                 const int x, const int y) {
+  uint8_t* pixel = finalBuffer.start + (x + y * width) * 3;
+  pixel[0] = 0;
+  pixel[1] = 255;
+  pixel[2] = 255;
+}
+
+void mergeHough(struct buffer<uint8_t>& finalBuffer,
+                const std::vector<struct HoughPeak>& peaks,
+                const unsigned int width,
+                const unsigned int height) {
+  for(const struct HoughPeak& peak : peaks) {
+    int ends[4];
+    if(peakEnds(peak, width, height, ends)) {
+      rasterise(ends[0], ends[1], ends[2], ends[3], [&](const int x, const int y) {
+        plot(finalBuffer, width, x, y);
+        return true;
+      });
+    }
+  }
+}
+
+void mergeSegments(struct buffer<uint8_t>& finalBuffer,
+                   const std::vector<struct LineSegment>& segments,
+                   const unsigned int width,
+                   const unsigned int height) {
+  for(const struct LineSegment& segment : segments) {
+    int x0 = segment.x0;
+    int y0 = segment.y0;
+    int x1 = segment.x1;
+    int y1 = segment.y1;
+    if(clipSegment(x0, y0, x1, y1, width, height)) {
+      rasterise(x0, y0, x1, y1, [&](const int x, const int y) {
+        plot(finalBuffer, width, x, y);
+        return true;
+      });
+    }
+  }
+}
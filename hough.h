@@ -0,0 +1,322 @@
+#ifndef WAZAT_HOUGH_H
+#define WAZAT_HOUGH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "types.h"
+#include "featuremap.h"
+
+/* Lines are r = x cos(a) + y sin(a) with a in degrees. a in [-90, 90)
+ * covers every line once, so that is the span of every accumulator. */
+#define HOUGH_ANGLES 180
+
+/* Larger than any |r| a pixel of a width x height frame can produce. */
+inline int houghMaxR(const unsigned int width, const unsigned int height) {
+  return (int)ceil(sqrt((double)width * width + (double)height * height)) + 1;
+}
+
+/* A window of a HoughTransform to vote round. Only pixels whose r, from
+ * gateTrig, is within gateReach of gateRow take part. */
+struct HoughRefine {
+  const int16_t* gateTrig;  // A trig table entry, of this or another transform.
+  int gateRow;              // Less its rowOffset.
+  int gateReach;
+  int column;               // Centre of the window.
+  int row;
+};
+
+/* A local maximum of a Hough accumulator, at the centre of its cell. */
+struct HoughPeak {
+  double r;
+  double a;
+  unsigned int votes;
+};
+
+/* A stretch of a detected line, end points inclusive. */
+struct LineSegment {
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+  struct polarCoord line;  // The line the segment lies on, rounded.
+  unsigned int votes;      // Accumulator value when it was detected.
+  unsigned int gaps;       // Pixels between its ends with no feature.
+};
+
+/* A feature pixel. */
+struct HoughPixel {
+  uint16_t x;
+  uint16_t y;
+};
+
+/* Threads kept from one run() to the next, so a job split over them every
+ * frame doesn't start new threads every frame. */
+class HoughWorkers {
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable changed;
+  std::function<void(unsigned int)> job;
+  uint64_t generation = 0;  // Bumped by each run().
+  unsigned int pending = 0;
+  bool running = true;
+
+  void worker(const unsigned int index, uint64_t seen);
+  void stop();
+
+ public:
+  ~HoughWorkers() {
+    stop();
+  }
+
+  /* Call job(index) for each index below count, count - 1 of them on the
+   * workers and one on the calling thread, and return once all are done.
+   * Workers are only started or stopped when count changes. */
+  void run(const unsigned int count, const std::function<void(unsigned int)>& job_);
+};
+
+/* The Hough transform for one frame size and quantisation. The accumulator
+ * has columns cells of angleStep degrees starting at a = -90, and rows cells
+ * of rStep pixels with r = 0 at row rowOffset. Cell (row, column) is
+ * accumulator.start[row * columns + column]. Tables and buffers belong to
+ * the object, so transforms of different sizes or steps can be used side by
+ * side. */
+class HoughTransform {
+  // Columns of trig, a whole number of AVX2 vectors past the last column so
+  // the radius kernels can start from any column.
+  unsigned int paddedColumns = 0;
+
+  // Cells vote() fills: columns [aBegin, aEnd), rows [rBegin, rEnd).
+  int aBegin = 0;
+  int aEnd = 0;
+  int rBegin = 0;
+  int rEnd = 0;
+
+  // For findPeaksCoarseToFine().
+  std::unique_ptr<HoughTransform> coarse;
+  std::vector<struct HoughPeak> coarsePeaks;
+
+  // For voteAround() and findPeaksCoarseToFine().
+  std::vector<struct HoughRefine> refineTargets;
+  std::vector<uint32_t> refineStamps;  // Last pixel to vote each column.
+  int refineReachA = 0;
+  int refineReachR = 0;
+
+  // For voteDecayed(), which set of pixels votes next.
+  unsigned int decayPhase = 0;
+
+  // For findSegmentsProbabilistic().
+  FeatureMap unclaimed;
+  FeatureMap voted;
+  std::vector<struct HoughPixel> pending;
+  std::vector<struct HoughPixel> path[2];
+
+  // For threaded voting. Each thread votes its columns into its own tile,
+  // a contiguous block of rows of just those columns, so no two threads
+  // write the same cache line while voting.
+  HoughWorkers workers;
+  std::vector<struct buffer<uint16_t>> tiles;
+
+  void voteColumns(const FeatureMap& features, uint16_t* origin, const int rowStride,
+                   const int columnBegin, const int columnEnd,
+                   const int rowBegin, const int rowEnd,
+                   const unsigned int stride, const unsigned int phase);
+  void voteThreaded(const FeatureMap& features, unsigned int threads,
+                    const unsigned int stride, const unsigned int phase);
+  void scanPeaks(std::vector<struct HoughPeak>& peaks,
+                 const unsigned int threshold,
+                 const int neighbourhood,
+                 const size_t maxPeaks,
+                 const int columnBegin, const int columnEnd,
+                 const int rowBegin, const int rowEnd) const;
+  size_t sortPeaks(std::vector<struct HoughPeak>& peaks, const int mergeDistance) const;
+  void voteTargets(const FeatureMap& features, const int reachA, const int reachR);
+
+ public:
+  unsigned int width = 0;
+  unsigned int height = 0;
+  unsigned int columns = 0;
+  int rows = 0;
+  int rowOffset = 0;
+  double angleStep = 0;
+  double rStep = 0;
+  struct buffer<uint16_t> accumulator = {0};
+
+  // Per column, cos(a) / rStep and sin(a) / rStep in Q14, interleaved so
+  // that one pmaddwd against an (x, y) pair gives the row less rowOffset.
+  std::vector<int16_t> trig;
+
+  HoughTransform() {}
+  HoughTransform(const HoughTransform&) = delete;
+  HoughTransform& operator=(const HoughTransform&) = delete;
+  ~HoughTransform() {
+    accumulator.destroy();
+    for(struct buffer<uint16_t>& tile : tiles) {
+      tile.destroy();
+    }
+  }
+
+  /* Set the frame size and the cell size. angleStep is adjusted so a whole
+   * number of cells spans HOUGH_ANGLES degrees and rStep is at least one
+   * pixel. Tables and the accumulator are only rebuilt, and the window
+   * reset, when one of them changes, so this is cheap to call every
+   * frame. */
+  void configure(const unsigned int width_,
+                 const unsigned int height_,
+                 const double angleStep_ = 1,
+                 const double rStep_ = 1);
+
+  /* Only vote for a in [aMin, aMax) degrees and r in [rMin, rMax) pixels,
+   * rounded out to whole cells and clipped to the accumulator. */
+  void setWindow(const double aMin, const double aMax, const double rMin, const double rMax);
+
+  /* Vote for every line. */
+  void clearWindow();
+
+  double angle(const int column) const {
+    return column * angleStep - HOUGH_ANGLES / 2;
+  }
+
+  double radius(const int row) const {
+    return (row - rowOffset) * rStep;
+  }
+
+  int column(const double a) const {
+    return (int)floor((a + HOUGH_ANGLES / 2) / angleStep + 0.5);
+  }
+
+  int row(const double r) const {
+    return (int)floor(r / rStep + 0.5) + rowOffset;
+  }
+
+  /* Clear the accumulator and vote every feature pixel into the window.
+   * Work is split over threads by column (0 for one per core) and gives the
+   * same result for any count. How well it scales is not yet measured. */
+  void vote(const FeatureMap& features, unsigned int threads = 1);
+
+  /* Like vote() but the accumulator carries over from the last call. It is
+   * first scaled by decay, then only one in stride feature pixels votes,
+   * taking turns so each votes once every stride calls. A line that stays
+   * put settles at about 1 / (stride * (1 - decay)) times the votes vote()
+   * would give it, so for stride 4 and decay 0.75 the same threshold works.
+   * Each call costs 1 / stride of vote() plus one pass over the
+   * accumulator, and peaks change smoothly from frame to frame. */
+  void voteDecayed(const FeatureMap& features,
+                   const double decay,
+                   const unsigned int stride,
+                   const unsigned int threads = 1);
+
+  /* Like vote() but each pixel only votes the columns within window degrees
+   * of its gradient from getFeatures(), since the line through it must run
+   * along the edge. A few degrees cut the votes by an order of magnitude and
+   * leave far less spread round each peak. */
+  void voteOriented(const FeatureMap& features,
+                    const struct buffer<uint8_t>& orientation,
+                    const double window);
+
+  /* One pass over the accumulator for the cells of at least threshold
+   * votes that are the largest within neighbourhood cells in r and a,
+   * angles wrapping round. Of equal cells only the first in memory is kept.
+   * Only the strongest maxPeaks are held, in a bounded heap. They are then
+   * sorted strongest first and any within mergeDistance cells in both r and
+   * a of a stronger one is dropped, so fewer than maxPeaks may come back.
+   * Returns peaks.size(). */
+  size_t findPeaks(std::vector<struct HoughPeak>& peaks,
+                   const unsigned int threshold,
+                   const int neighbourhood,
+                   const size_t maxPeaks,
+                   const int mergeDistance) const;
+
+  /* Clear the accumulator and vote only within aReach degrees and rReach
+   * pixels of each line of around, with the pixels that could reach there.
+   * For following lines already found, at a cost of about one test per line
+   * for each pixel plus votes from the pixels near the lines. The windows
+   * are voted margin cells wider than findPeaksAround() searches. */
+  void voteAround(const FeatureMap& features,
+                  const std::vector<struct HoughPeak>& around,
+                  const double aReach,
+                  const double rReach,
+                  const int margin = 0);
+
+  /* findPeaks() over just the windows of the last voteAround(). */
+  size_t findPeaksAround(std::vector<struct HoughPeak>& peaks,
+                         const unsigned int threshold,
+                         const int neighbourhood,
+                         const size_t maxPeaks,
+                         const int mergeDistance) const;
+
+  /* Progressive probabilistic Hough transform (Matas, Galambos and
+   * Kittler), over the whole accumulator whatever the window. Feature pixels
+   * vote one at a time in random order. As soon as a cell reaches threshold
+   * the line is followed through the feature map both ways from the pixel
+   * that tipped it, taking features within a pixel of it and moving over to
+   * them, across gaps of up to maxGap pixels. Pixels along it are claimed so
+   * they never vote again, and their votes are withdrawn if the segment is
+   * at least minLength long, in which case it is added to segments. Stops
+   * after maxLines segments or once budget pixels have voted. Returns the
+   * number of pixels that voted. */
+  size_t findSegmentsProbabilistic(const FeatureMap& features,
+                                   std::vector<struct LineSegment>& segments,
+                                   const unsigned int threshold,
+                                   const unsigned int minLength,
+                                   const unsigned int maxGap,
+                                   const size_t maxLines,
+                                   const size_t budget);
+
+  /* vote() and findPeaks() at factor times the cell size, then
+   * voteAround() each coarse peak at full resolution and find the peaks
+   * there. The windows reach one coarse cell in angle, and in r one coarse
+   * cell plus how far a line one coarse cell off in angle spreads across
+   * the frame. Each pixel costs about columns / factor votes plus one test
+   * per coarse peak, instead of columns votes. A weak line whose coarse cell
+   * loses to a coarse peak further than a cell away can still be missed.
+   * Build with -DHOUGH_CHECK to compare every call with the full
+   * transform. */
+  size_t findPeaksCoarseToFine(const FeatureMap& features,
+                               std::vector<struct HoughPeak>& peaks,
+                               const unsigned int factor,
+                               const unsigned int threshold,
+                               const int neighbourhood,
+                               const size_t maxPeaks,
+                               const int mergeDistance,
+                               const unsigned int threads = 1);
+};
+
+/* Walk the line of each peak across the frame and return the stretches of
+ * feature pixels along it. A pixel counts if a feature lies within
+ * tolerance pixels of it across the line, and runs of up to maxGap pixels
+ * with none are bridged. Where no stretch has started the search reaches
+ * further, by as much as an angleStep cell's line can stray from the one
+ * in the image. Stretches shorter than minLength are dropped.
+ * Each peak costs the length of its line, whatever the accumulator size.
+ * Returns segments.size(). */
+size_t extractSegments(const FeatureMap& inputBuffer,
+                       const std::vector<struct HoughPeak>& peaks,
+                       std::vector<struct LineSegment>& segments,
+                       const unsigned int width,
+                       const unsigned int height,
+                       const unsigned int minLength,
+                       const unsigned int maxGap,
+                       const int tolerance,
+                       const double angleStep);
+
+/* Draw the full line of each peak, clipped to the frame. */
+void mergeHough(struct buffer<uint8_t>& finalBuffer,
+                const std::vector<struct HoughPeak>& peaks,
+                const unsigned int width,
+                const unsigned int height);
+
+/* Draw each segment, clipped to the frame. */
+void mergeSegments(struct buffer<uint8_t>& finalBuffer,
+                   const std::vector<struct LineSegment>& segments,
+                   const unsigned int width,
+                   const unsigned int height);
+
+#endif  // WAZAT_HOUGH_H
@@ -1,4 +1,10 @@
 #include "inputs.h"
+#include "outputs.h"
+#include "config.h"
+
+#include <csetjmp>
+#include <cmath>
+#include <dirent.h>
 
 static void xioctl(int fh, int request, void *arg)
 {
@@ -22,11 +28,18 @@ void errno_exit(const char *s) {
 Camera::Camera(const char* deviceName_,
                enum IoMethod io_,
                void** cameraBuffer_,
-               size_t* bufferLength_){
+               size_t* bufferLength_,
+               unsigned int ringSize_,
+               enum DropPolicy policy_,
+               enum PixelFormat pixelFormat_){
   deviceName = deviceName_;
   io = io_;
   cameraBuffer = cameraBuffer_;
   bufferLength = bufferLength_;
+  ringSize = std::min(std::max(ringSize_, 2u), 8u);
+  policy = policy_;
+  pixelFormat = pixelFormat_;
+  numBuffers = 0;
 
   // Open devce.
   fd = v4l2_open(deviceName, O_RDWR | O_NONBLOCK, 0);
@@ -40,52 +53,347 @@ Camera::Camera(const char* deviceName_,
   setFormat();
   setBuffers();
   prepareBuffer();
+  startCapture();
   getImageProperties();
 }
 
 Camera::~Camera(){
+  stopCapture();
+  delete recorder.load();
+
   // Deactivate streaming
   enum v4l2_buf_type type;
   switch (io) {
     case IO_METHOD_READ:
-      /* Nothing to do. */
+      for (unsigned int i = 0; i < numBuffers; ++i)
+        freeAligned(buffers[i].start);
       break;
     case IO_METHOD_MMAP_SINGLE:
     case IO_METHOD_MMAP_DOUBLE:
+    case IO_METHOD_MMAP_RING:
       type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
       xioctl(fd, VIDIOC_STREAMOFF, &type);
       for (unsigned int i = 0; i < numBuffers; ++i)
         v4l2_munmap(buffers[i].start, buffers[i].length);
       break;
+    case IO_METHOD_USERPTR:
+      type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+      xioctl(fd, VIDIOC_STREAMOFF, &type);
+      for (unsigned int i = 0; i < numBuffers; ++i)
+        freeAligned(buffers[i].start);
+      break;
   }
 
+  rgbBuffer.destroy();
+
   std::cout << "Closing " << deviceName << "\n";
+  std::cout << "Frames captured: " << stats.captured <<
+               " dropped: " << stats.dropped <<
+               " dropped by driver: " << stats.driverDropped <<
+               " stale: " << stats.stale <<
+               " rejected: " << stats.rejected << "\n";
   v4l2_close(fd);
 }
 
 int Camera::grabFrame(){
+  if(pixelFormat == PIXEL_FORMAT_MJPEG) {
+    return grabDecoded();
+  }
+
+  releaseFrame(grabbed);
+  if(!acquireFrame(grabbed)) {
+    std::cout << "Waiting for Frame" << std::endl;
+    return 0;
+  }
+
+  switch (pixelFormat) {
+    case PIXEL_FORMAT_RGB24:
+      timestamp = grabbed.timestamp;
+      *cameraBuffer = grabbed.start;
+      *bufferLength = grabbed.length;
+      break;
+    case PIXEL_FORMAT_YUYV:
+      timestamp = grabbed.timestamp;
+      rgbBuffer.resize(captureWidth * captureHeight * 3);
+      yuyvToRgb(grabbed.start, bytesPerLine, rgbBuffer.start,
+                captureWidth, captureHeight);
+      // Converted, so the driver can have the buffer straight back.
+      releaseFrame(grabbed);
+      *cameraBuffer = rgbBuffer.start;
+      *bufferLength = rgbBuffer.length;
+      break;
+    case PIXEL_FORMAT_MJPEG:
+      assert(false && "MJPEG frames come from grabDecoded().");
+      break;
+  }
+  return 1;
+}
+
+int Camera::grabDecoded(){
+  unsigned int decodedWidth;
+  unsigned int decodedHeight;
+  uint32_t sequence;
+  while(true) {
+    uint64_t skipped = 0;
+    if(!decodePool->collect(rgbBuffer, decodedWidth, decodedHeight, sequence,
+                            timestamp, policy == DROP_POLICY_OLDEST, 2000, skipped)) {
+      std::cout << "Waiting for Frame" << std::endl;
+      return 0;
+    }
+    stats.stale += skipped;
+    if(decodedWidth == (unsigned int)captureWidth &&
+       decodedHeight == (unsigned int)captureHeight) {
+      break;
+    }
+    // The rest of the pipeline is sized for the capture, so a frame the
+    // camera encoded at some other size can only be dropped.
+    stats.rejected++;
+  }
+
+  *cameraBuffer = rgbBuffer.start;
+  *bufferLength = decodedWidth * decodedHeight * 3;
+  return 1;
+}
+
+int Camera::grabLuma(struct buffer<uint8_t>& lumaBuffer){
+  assert(pixelFormat == PIXEL_FORMAT_YUYV && "Luma needs a YUV capture format.");
+
+  FrameLease lease;
+  if(!acquireFrame(lease)) {
+    std::cout << "Waiting for Frame" << std::endl;
+    return 0;
+  }
+  lumaBuffer.resize(captureWidth * captureHeight);
+  yuyvToLuma(lease.start, bytesPerLine, lumaBuffer.start,
+             captureWidth, captureHeight);
+  releaseFrame(lease);
+  return 1;
+}
+
+bool Camera::acquireFrame(FrameLease& lease, unsigned int timeoutMs){
+  assert(lease.index < 0 && "Lease still holds a frame.");
+  assert(pixelFormat != PIXEL_FORMAT_MJPEG);
+
+  std::unique_lock<std::mutex> lock(readyLock);
+  if(!readyCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+                              [this]{ return !ready.empty(); })) {
+    return false;
+  }
+
+  if(policy == DROP_POLICY_BLOCK) {
+    lease = ready.front();
+    ready.pop_front();
+  } else {
+    // Only the newest frame is of interest. Anything older goes straight back
+    // to the driver.
+    lease = ready.back();
+    ready.pop_back();
+    while(!ready.empty()) {
+      queueBuffer(ready.front().index);
+      ready.pop_front();
+      stats.stale++;
+    }
+  }
+  leased++;
+  readyCondition.notify_all();
+  return true;
+}
+
+void Camera::releaseFrame(FrameLease& lease){
+  if(lease.index < 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(readyLock);
+  queueBuffer(lease.index);
+  leased--;
+  readyCondition.notify_all();
+  lease = FrameLease();
+}
+
+void Camera::startRecording(const char* filename, size_t byteBudget){
+  assert(recorder.load() == nullptr && "Already recording.");
+  recorder = new Recorder(filename, captureWidth, captureHeight, pixelFormat,
+                          pixelFormat == PIXEL_FORMAT_MJPEG ? 0 : bytesPerLine,
+                          byteBudget);
+}
+
+void Camera::queueBuffer(unsigned int index){
+  inDriver++;
+  if(io == IO_METHOD_READ) {
+    freeBuffers.push_back(index);
+    return;
+  }
+
+  struct v4l2_buffer bufferinfo = {0};
+  bufferinfo.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  bufferinfo.index = index;
+  if(io == IO_METHOD_USERPTR) {
+    bufferinfo.memory = V4L2_MEMORY_USERPTR;
+    bufferinfo.m.userptr = (unsigned long)buffers[index].start;
+    bufferinfo.length = buffers[index].length;
+  } else {
+    bufferinfo.memory = V4L2_MEMORY_MMAP;
+  }
+  xioctl(fd, VIDIOC_QBUF, &bufferinfo);
+}
+
+void Camera::startCapture(){
+  if(pixelFormat == PIXEL_FORMAT_MJPEG) {
+    const unsigned int workers = std::max(2u, std::thread::hardware_concurrency() / 2);
+    std::cout << "Decoding MJPEG on " << workers << " threads\n";
+    decodePool = new JpegDecodePool(workers, workers + 2);
+  }
+  running = true;
+  captureThread = std::thread(&Camera::captureLoop, this);
+}
+
+void Camera::stopCapture(){
+  releaseFrame(grabbed);
+  {
+    std::lock_guard<std::mutex> lock(readyLock);
+    // The buffers are unmapped next, so no lease may still point into them.
+    assert(leased == 0 && "A frame lease is still outstanding.");
+    running = false;
+  }
+  readyCondition.notify_all();
+  if(captureThread.joinable()) {
+    captureThread.join();
+  }
+  delete decodePool;
+  decodePool = nullptr;
+}
+
+void Camera::captureLoop(){
+  while(true) {
+    {
+      std::unique_lock<std::mutex> lock(readyLock);
+      if(policy == DROP_POLICY_BLOCK) {
+        // Don't take the driver's last buffer while the consumer still has
+        // something to read; it would only have to be dropped.
+        readyCondition.wait(lock, [this]{
+            return !running || inDriver > 1 || ready.empty(); });
+      }
+      if(!running) {
+        return;
+      }
+    }
+
+    FrameLease frame;
+    if(!dequeueFrame(frame)) {
+      continue;
+    }
+    stats.captured++;
+
+    if(haveSequence && frame.sequence > lastSequence + 1) {
+      stats.driverDropped += frame.sequence - lastSequence - 1;
+    }
+    haveSequence = true;
+    lastSequence = frame.sequence;
+
+    if(Recorder* recording = recorder.load()) {
+      recording->record(frame.start, frame.length, frame.timestamp);
+    }
+
+    if(decodePool) {
+      // The pool copies the compressed frame, which is small, so the driver
+      // can have the buffer back straight away.
+      // Under DROP_POLICY_OLDEST a full pool makes room by evicting its
+      // oldest frame, so the consumer always gets the newest ones.
+      uint64_t evicted = 0;
+      bool queued = decodePool->submit(frame.start, frame.length, frame.sequence,
+                                       frame.timestamp, 0, policy == DROP_POLICY_OLDEST,
+                                       evicted);
+      while(!queued && policy == DROP_POLICY_BLOCK && running) {
+        queued = decodePool->submit(frame.start, frame.length, frame.sequence,
+                                    frame.timestamp, 100, false, evicted);
+      }
+      stats.stale += evicted;
+      if(!queued) {
+        stats.dropped++;
+      }
+
+      std::lock_guard<std::mutex> lock(readyLock);
+      inDriver--;
+      queueBuffer(frame.index);
+      continue;
+    }
+
+    std::lock_guard<std::mutex> lock(readyLock);
+    inDriver--;
+    ready.push_back(frame);
+    // Keep at least one buffer with the driver, otherwise it has nowhere to
+    // put the next frame.
+    if(inDriver == 0 && ready.size() > 1) {
+      queueBuffer(ready.front().index);
+      ready.pop_front();
+      stats.dropped++;
+    }
+    readyCondition.notify_all();
+  }
+}
+
+bool Camera::dequeueFrame(FrameLease& frame){
+  unsigned int readIndex = 0;
+  if(io == IO_METHOD_READ) {
+    // Need somewhere to read into before the data is worth waiting for.
+    std::unique_lock<std::mutex> lock(readyLock);
+    if(!readyCondition.wait_for(lock, std::chrono::milliseconds(100),
+                                [this]{ return !running || !freeBuffers.empty(); }) ||
+        !running) {
+      return false;
+    }
+    readIndex = freeBuffers.front();
+    freeBuffers.pop_front();
+  }
+
   fd_set fds;
   FD_ZERO(&fds);
   FD_SET(fd, &fds);
+  // Short timeout so a shutdown request is noticed promptly.
   struct timeval tv = {0};
-  tv.tv_sec = 2;
-  tv.tv_usec = 0;
+  tv.tv_sec = 0;
+  tv.tv_usec = 100000;
   int r = select(fd+1, &fds, NULL, NULL, &tv);
-  if(0 == r) {
-    std::cout << "Waiting for Frame" << std::endl;
-    return 0;
+
+  if(io == IO_METHOD_READ) {
+    ssize_t length = -1;
+    if(r > 0) {
+      length = v4l2_read(fd, buffers[readIndex].start, buffers[readIndex].length);
+      if(length < 0 && errno != EAGAIN && errno != EINTR) {
+        errno_exit("read");
+      }
+    }
+    if(length <= 0) {
+      std::lock_guard<std::mutex> lock(readyLock);
+      freeBuffers.push_front(readIndex);
+      return false;
+    }
+    frame.index = readIndex;
+    frame.start = buffers[readIndex].start;
+    frame.length = length;
+    frame.sequence = readSequence++;
+    gettimeofday(&frame.timestamp, NULL);
+    return true;
+  }
+
+  if(r <= 0) {
+    return false;
   }
 
   // The buffer's waiting in the outgoing queue.
+  struct v4l2_buffer bufferinfo = {0};
+  bufferinfo.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  bufferinfo.memory =
+    io == IO_METHOD_USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
   xioctl(fd, VIDIOC_DQBUF, &bufferinfo);
 
-  *cameraBuffer = buffers[bufferinfo.index].start;
-  *bufferLength = bufferinfo.length;
-  //*bufferLength = bufferinfo.bytesused;
-
-  // Put the buffer in the incoming queue
-  xioctl(fd, VIDIOC_QBUF, &bufferinfo);
-  return 1;
+  frame.index = bufferinfo.index;
+  frame.start = buffers[bufferinfo.index].start;
+  frame.length = bufferinfo.bytesused ? bufferinfo.bytesused : buffers[bufferinfo.index].length;
+  frame.sequence = bufferinfo.sequence;
+  frame.timestamp = bufferinfo.timestamp;
+  return true;
 }
 
 void Camera::checkCapabilities(){
@@ -109,7 +417,9 @@ void Camera::checkCapabilities(){
       break;
     case IO_METHOD_MMAP_SINGLE:
     case IO_METHOD_MMAP_DOUBLE:
-      std::cout << "Using IO_METHOD_MMAP\n";
+    case IO_METHOD_MMAP_RING:
+    case IO_METHOD_USERPTR:
+      std::cout << "Using streaming i/o\n";
       if (!(capabilities.capabilities & V4L2_CAP_STREAMING)) {
         std::cout << "Error: " << deviceName << " does not support streaming i/o\n";
         exit(EXIT_FAILURE);
@@ -139,6 +449,19 @@ void Camera::getImageProperties(){
 }
 
 void Camera::setFormat(){
+  uint32_t pixelformat = V4L2_PIX_FMT_RGB24;
+  switch (pixelFormat) {
+    case PIXEL_FORMAT_RGB24:
+      pixelformat = V4L2_PIX_FMT_RGB24;
+      break;
+    case PIXEL_FORMAT_YUYV:
+      pixelformat = V4L2_PIX_FMT_YUYV;
+      break;
+    case PIXEL_FORMAT_MJPEG:
+      pixelformat = V4L2_PIX_FMT_MJPEG;
+      break;
+  }
+
   memset(&format, 0, sizeof(struct v4l2_format));
   format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   format.fmt.pix.width = 1200;
@@ -147,10 +470,20 @@ void Camera::setFormat(){
   //format.fmt.pix.height = 720;
   //format.fmt.pix.width = 1280 / 2;
   //format.fmt.pix.height = 720 / 2;
-  format.fmt.pix.pixelformat =  V4L2_PIX_FMT_RGB24;
+  format.fmt.pix.pixelformat = pixelformat;
 
   xioctl(fd, VIDIOC_S_FMT, &format);
-  if (format.fmt.pix.pixelformat != V4L2_PIX_FMT_RGB24) {
+  if (format.fmt.pix.pixelformat != pixelformat && pixelFormat != PIXEL_FORMAT_RGB24) {
+    // libv4l2 can give us RGB24 from any camera, so fall back to that.
+    std::cout << deviceName << " can't capture in the requested format. Using RGB24.\n";
+    pixelFormat = PIXEL_FORMAT_RGB24;
+    pixelformat = V4L2_PIX_FMT_RGB24;
+    format.fmt.pix.width = 1200;
+    format.fmt.pix.height = 600;
+    format.fmt.pix.pixelformat = pixelformat;
+    xioctl(fd, VIDIOC_S_FMT, &format);
+  }
+  if (format.fmt.pix.pixelformat != pixelformat) {
     std::cout << "Image not in recognised format. Can't proceed." << std::endl;
     std::cout << (char)(format.fmt.pix.pixelformat) << " " <<
                  (char)(format.fmt.pix.pixelformat >> 8) << " " <<
@@ -161,6 +494,14 @@ void Camera::setFormat(){
 
   captureWidth = format.fmt.pix.width;
   captureHeight = format.fmt.pix.height;
+  bytesPerLine = format.fmt.pix.bytesperline;
+  imageSize = format.fmt.pix.sizeimage;
+  if(pixelFormat == PIXEL_FORMAT_YUYV && bytesPerLine < (size_t)captureWidth * 2) {
+    bytesPerLine = captureWidth * 2;
+  }
+  if(pixelFormat == PIXEL_FORMAT_RGB24 && bytesPerLine < (size_t)captureWidth * 3) {
+    bytesPerLine = captureWidth * 3;
+  }
   std::cout << "Image width set to " << captureWidth << " by device " << deviceName << ".\n";
   std::cout << "Image height set to " << captureHeight << " by device " << deviceName << ".\n";
 }
@@ -168,8 +509,7 @@ void Camera::setFormat(){
 void Camera::setBuffers(){
   switch (io) {
     case IO_METHOD_READ:
-      //init_read(format.fmt.pix.sizeimage);
-      assert(false && "TODO");
+      initRead(ringSize);
       break;
 
     case IO_METHOD_MMAP_SINGLE:
@@ -179,6 +519,14 @@ void Camera::setBuffers(){
     case IO_METHOD_MMAP_DOUBLE:
       initMmap(2);
       break;
+
+    case IO_METHOD_MMAP_RING:
+      initMmap(ringSize);
+      break;
+
+    case IO_METHOD_USERPTR:
+      initUserptr(ringSize);
+      break;
   }
 
 
@@ -216,7 +564,7 @@ void Camera::setControl(int id, int value){
 }
 
 void Camera::initMmap(unsigned int numBuffers_) {
-  std::cout << "Using IO_METHOD_MMAP_SINGLE\n";
+  std::cout << "Requesting " << numBuffers_ << " mmap buffers\n";
 
   numBuffers = numBuffers_;
 
@@ -226,6 +574,12 @@ void Camera::initMmap(unsigned int numBuffers_) {
   bufrequest.memory = V4L2_MEMORY_MMAP;
 
   xioctl(fd, VIDIOC_REQBUFS, &bufrequest);
+  if(bufrequest.count < 1) {
+    std::cout << "Error: " << deviceName << " gave us no buffers\n";
+    exit(EXIT_FAILURE);
+  }
+  std::cout << "Driver allocated " << bufrequest.count << " buffers\n";
+  buffers.resize(bufrequest.count);
 
   struct v4l2_buffer bufferinfo = {0};
   for (numBuffers = 0; numBuffers < bufrequest.count; ++numBuffers) {
@@ -249,21 +603,276 @@ void Camera::initMmap(unsigned int numBuffers_) {
   }
 }
 
+void Camera::initUserptr(unsigned int numBuffers_) {
+  std::cout << "Requesting " << numBuffers_ << " user pointer buffers\n";
+
+  struct v4l2_requestbuffers bufrequest = {0};
+  bufrequest.count = numBuffers_;
+  bufrequest.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  bufrequest.memory = V4L2_MEMORY_USERPTR;
+
+  int r;
+  do {
+    r = v4l2_ioctl(fd, VIDIOC_REQBUFS, &bufrequest);
+  } while (r == -1 && ((errno == EINTR) || (errno == EAGAIN)));
+  if (r == -1 && errno == EINVAL) {
+    // Not every driver, nor libv4l2 when it converts, does user pointers.
+    std::cout << deviceName << " does not support user pointer i/o. Using mmap.\n";
+    io = IO_METHOD_MMAP_RING;
+    initMmap(numBuffers_);
+    return;
+  }
+  if (r == -1) {
+    errno_exit("VIDIOC_REQBUFS");
+  }
+  if(bufrequest.count < 1) {
+    std::cout << "Error: " << deviceName << " accepted no buffers\n";
+    exit(EXIT_FAILURE);
+  }
+
+  numBuffers = bufrequest.count;
+  buffers.resize(numBuffers);
+  for (unsigned int i = 0; i < numBuffers; ++i) {
+    buffers[i].length = imageSize;
+    buffers[i].start = (uint8_t*)allocateAligned(imageSize);
+    if(buffers[i].start == nullptr) {
+      errno_exit("allocateAligned");
+    }
+  }
+}
+
+void Camera::initRead(unsigned int numBuffers_) {
+  std::cout << "Allocating " << numBuffers_ << " read buffers\n";
+
+  numBuffers = numBuffers_;
+  buffers.resize(numBuffers);
+  for (unsigned int i = 0; i < numBuffers; ++i) {
+    buffers[i].length = imageSize;
+    buffers[i].start = (uint8_t*)allocateAligned(imageSize);
+    if(buffers[i].start == nullptr) {
+      errno_exit("allocateAligned");
+    }
+  }
+}
+
 void Camera::prepareBuffer(){
   for (unsigned int i = 0; i < numBuffers; ++i) {
-    memset(&bufferinfo, 0, sizeof(bufferinfo));
-    bufferinfo.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bufferinfo.memory = V4L2_MEMORY_MMAP;
-    bufferinfo.index = i;
-    xioctl(fd, VIDIOC_QBUF, &bufferinfo);
+    queueBuffer(i);
+  }
+
+  if(io == IO_METHOD_READ) {
+    return;
   }
 
   // Activate streaming
-  int type = bufferinfo.type;
+  int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   xioctl(fd, VIDIOC_STREAMON, &type);
 }
 
 
+/* libjpeg's default error handler exits the process. A camera will send the
+ * odd corrupt frame, so the decode pool jumps back out and drops it instead. */
+struct JpegErrorManager {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr cinfo) {
+  longjmp(((JpegErrorManager*)cinfo->err)->jump, 1);
+}
+
+static void jpegOutputMessage(j_common_ptr cinfo) {
+  // Warnings would scribble over the curses display.
+}
+
+/* A libjpeg decompressor that is set up once and reused for every frame. */
+struct JpegDecoder {
+  struct jpeg_decompress_struct cinfo;
+  JpegErrorManager jerr;
+
+  JpegDecoder() {
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpegErrorExit;
+    jerr.pub.output_message = jpegOutputMessage;
+    jpeg_create_decompress(&cinfo);
+  }
+
+  ~JpegDecoder() {
+    jpeg_destroy_decompress(&cinfo);
+  }
+
+  bool decode(const uint8_t* data,
+              size_t length,
+              struct buffer<uint8_t>& rgb,
+              unsigned int& width,
+              unsigned int& height) {
+    if(setjmp(jerr.jump)) {
+      jpeg_abort_decompress(&cinfo);
+      return false;
+    }
+
+    jpeg_mem_src(&cinfo, data, length);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    width = cinfo.output_width;
+    height = cinfo.output_height;
+    const unsigned int row_stride = width * 3;
+    rgb.resize(row_stride * height);
+
+    while (cinfo.output_scanline < cinfo.output_height){
+      const unsigned int count = std::min(4u, cinfo.output_height - cinfo.output_scanline);
+      JSAMPROW rows[4];
+      for(unsigned int i = 0; i < count; i++) {
+        rows[i] = rgb.start + (cinfo.output_scanline + i) * row_stride;
+      }
+      jpeg_read_scanlines(&cinfo, rows, count);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    return true;
+  }
+};
+
+JpegDecodePool::JpegDecodePool(unsigned int numWorkers,
+                               unsigned int maxInFlight) :
+                                  slots(std::max(maxInFlight, 1u)) {
+  for(unsigned int i = 0; i < numWorkers; i++) {
+    workers.push_back(std::thread(&JpegDecodePool::worker, this));
+  }
+}
+
+JpegDecodePool::~JpegDecodePool() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    running = false;
+  }
+  changed.notify_all();
+  for(std::thread& worker : workers) {
+    worker.join();
+  }
+  for(Slot& slot : slots) {
+    slot.rgb.destroy();
+  }
+}
+
+JpegDecodePool::Slot* JpegDecodePool::oldest(unsigned int mask) {
+  Slot* found = nullptr;
+  for(Slot& slot : slots) {
+    if((mask & (1u << slot.state)) && (!found || slot.order < found->order)) {
+      found = &slot;
+    }
+  }
+  return found;
+}
+
+bool JpegDecodePool::submit(const uint8_t* data,
+                            size_t length,
+                            uint32_t sequence,
+                            const struct timeval& timestamp,
+                            unsigned int timeoutMs,
+                            bool evictOldest,
+                            uint64_t& evicted) {
+  std::unique_lock<std::mutex> guard(lock);
+  const unsigned int free = 1u << Slot::FREE;
+  Slot* slot = nullptr;
+  if(changed.wait_for(guard, std::chrono::milliseconds(timeoutMs),
+                      [&]{ return oldest(free) != nullptr; })) {
+    slot = oldest(free);
+  } else if(evictOldest) {
+    // A slot being decoded belongs to its worker until it is done.
+    slot = oldest(1u << Slot::QUEUED | 1u << Slot::DONE | 1u << Slot::FAILED);
+    if(slot && slot->state != Slot::FAILED) {
+      evicted++;
+    }
+  }
+  if(!slot) {
+    return false;
+  }
+
+  slot->compressed.assign(data, data + length);
+  slot->sequence = sequence;
+  slot->timestamp = timestamp;
+  slot->order = nextIn++;
+  slot->state = Slot::QUEUED;
+  changed.notify_all();
+  return true;
+}
+
+bool JpegDecodePool::collect(struct buffer<uint8_t>& rgb,
+                             unsigned int& width,
+                             unsigned int& height,
+                             uint32_t& sequence,
+                             struct timeval& timestamp,
+                             bool newest,
+                             unsigned int timeoutMs,
+                             uint64_t& skipped) {
+  // Frames come out in submit order, so only the oldest one in use can be
+  // taken.
+  const unsigned int inUse = ~(1u << Slot::FREE);
+  auto finished = [&]{
+    const Slot* slot = oldest(inUse);
+    return slot && (slot->state == Slot::DONE || slot->state == Slot::FAILED);
+  };
+  const auto deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+  std::unique_lock<std::mutex> guard(lock);
+  bool found = false;
+  while(true) {
+    if(!finished()) {
+      if(found || !changed.wait_until(guard, deadline, finished)) {
+        break;
+      }
+    }
+
+    Slot& slot = *oldest(inUse);
+    if(slot.state == Slot::DONE) {
+      if(found) {
+        skipped++;
+      }
+      // Swap rather than copy. The slot reuses whatever buffer it gets back.
+      std::swap(slot.rgb, rgb);
+      width = slot.width;
+      height = slot.height;
+      sequence = slot.sequence;
+      timestamp = slot.timestamp;
+      found = true;
+    }
+    slot.state = Slot::FREE;
+    changed.notify_all();
+    if(found && !newest) {
+      break;
+    }
+  }
+  return found;
+}
+
+void JpegDecodePool::worker() {
+  JpegDecoder decoder;
+  const unsigned int queued = 1u << Slot::QUEUED;
+
+  std::unique_lock<std::mutex> guard(lock);
+  while(true) {
+    changed.wait(guard, [&]{ return !running || oldest(queued) != nullptr; });
+    if(!running) {
+      break;
+    }
+    Slot& slot = *oldest(queued);
+    slot.state = Slot::DECODING;
+
+    guard.unlock();
+    const bool decoded =
+      decoder.decode(slot.compressed.data(), slot.compressed.size(),
+                     slot.rgb, slot.width, slot.height);
+    guard.lock();
+
+    slot.state = decoded ? Slot::DONE : Slot::FAILED;
+    changed.notify_all();
+  }
+}
+
 File::File(const char* filename_,
            struct buffer<uint8_t>& buffer_) :
               filename(filename_),
@@ -280,38 +889,89 @@ File::~File() {
   }
 }
 
+/* Decoded images by path, shared by every File. */
+static std::mutex frameCacheLock;
+static std::map<std::string, std::shared_ptr<const DecodedImage>> frameCache;
+
+static JpegRegion configRegion() {
+  JpegRegion region;
+  if(config.fileDecode.enabled) {
+    region.scale = config.fileDecode.values[0].value;
+    region.left = config.fileDecode.values[1].value;
+    region.top = config.fileDecode.values[2].value;
+    region.width = config.fileDecode.values[3].value;
+    region.height = config.fileDecode.values[4].value;
+  }
+  return region;
+}
+
+static bool isCurrent(const std::shared_ptr<const DecodedImage>& image,
+                      const struct stat& info,
+                      const JpegRegion& region) {
+  return image &&
+    image->mtime.tv_sec == info.st_mtim.tv_sec &&
+    image->mtime.tv_nsec == info.st_mtim.tv_nsec &&
+    image->size == info.st_size &&
+    image->region == region;
+}
+
 int File::grabFrame() {
-  std::ifstream file(filename, std::ios::in|std::ios::binary|std::ios::ate);
-  if(file.is_open()) {
-    std::streampos size = file.tellg();
-    internalBuffer.resize(size);
+  struct stat info;
+  if(stat(filename, &info) < 0) {
+    std::cout << "Could not read file: " << filename << std::endl;
+    return -1;
+  }
 
-    file.seekg (0, std::ios::beg);
-    file.read (((char*)internalBuffer.start), size);
-    file.close();
+  const JpegRegion region = configRegion();
+  if(!isCurrent(decoded, info, region)) {
+    std::unique_lock<std::mutex> guard(frameCacheLock);
+    std::shared_ptr<const DecodedImage>& entry = frameCache[filename];
+    if(isCurrent(entry, info, region)) {
+      decoded = entry;
+    } else {
+      guard.unlock();
+      std::shared_ptr<const DecodedImage> fresh = decodeFile(info, region);
+      if(!fresh) {
+        std::cout << "Could not read file: " << filename << std::endl;
+        return -1;
+      }
+      guard.lock();
+      frameCache[filename] = fresh;
+      decoded = fresh;
+    }
+  }
 
-    parseJpeg(&internalBuffer, externalBuffer, width, height);
-    return externalBuffer->length;
+  width = decoded->width;
+  height = decoded->height;
+  externalBuffer->resize(decoded->rgb.length);
+  memcpy(externalBuffer->start, decoded->rgb.start, decoded->rgb.length);
+  return externalBuffer->length;
+}
+
+std::shared_ptr<const DecodedImage> File::decodeFile(const struct stat& info,
+                                                     const JpegRegion& region) {
+  std::ifstream file(filename, std::ios::in|std::ios::binary|std::ios::ate);
+  if(!file.is_open()) {
+    return nullptr;
   }
-  std::cout << "Could not read file: " << filename << std::endl;
-  return -1;
+  std::streampos size = file.tellg();
+  internalBuffer.resize(size);
+
+  file.seekg (0, std::ios::beg);
+  file.read (((char*)internalBuffer.start), size);
+  file.close();
+
+  std::shared_ptr<DecodedImage> image = std::make_shared<DecodedImage>();
+  parseJpeg(&internalBuffer, &image->rgb, image->width, image->height, region);
+  image->region = region;
+  image->mtime = info.st_mtim;
+  image->size = info.st_size;
+  return image;
 }
 
 void File::getImageProperties(){
   size_t size = grabFrame();
 
-  struct jpeg_decompress_struct cinfo;
-  struct jpeg_error_mgr jerr;
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_decompress(&cinfo);
-  jpeg_mem_src(&cinfo, (unsigned char*)(internalBuffer.start), internalBuffer.length);
-  jpeg_read_header(&cinfo, TRUE);
-  jpeg_calc_output_dimensions(&cinfo);
-
-  width = cinfo.image_width;
-  height = cinfo.image_height;
-
-  jpeg_destroy_decompress(&cinfo);
   std::cout << "getImageProperties\t" << width << "," << height << std::endl;
   assert(size >= width * height * 3);
 }
@@ -319,7 +979,8 @@ void File::getImageProperties(){
 void File::parseJpeg(struct buffer<uint8_t>* inputBuffer,
                      struct buffer<uint8_t>* outputBuffer,
                      unsigned int& width,
-                     unsigned int& height) {
+                     unsigned int& height,
+                     const JpegRegion& region) {
   struct jpeg_decompress_struct cinfo;
   struct jpeg_error_mgr jerr;
   cinfo.err = jpeg_std_error(&jerr);
@@ -328,23 +989,638 @@ void File::parseJpeg(struct buffer<uint8_t>* inputBuffer,
   jpeg_mem_src(&cinfo, (uint8_t*)inputBuffer->start, inputBuffer->length);
 
   jpeg_read_header(&cinfo, TRUE);
-  unsigned int row_stride = cinfo.image_width * cinfo.num_components;
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.scale_num = std::min(std::max(region.scale, 1u), 8u);
+  cinfo.scale_denom = 8;
 
   jpeg_start_decompress(&cinfo);
 
-  width = cinfo.image_width;
-  height = cinfo.image_height;
+  // Region of interest in scaled pixels.
+  const unsigned int scaledWidth = cinfo.output_width;
+  const unsigned int scaledHeight = cinfo.output_height;
+  JDIMENSION left = std::min(region.left, 1.0) * scaledWidth;
+  JDIMENSION cropWidth = std::max(1u, (unsigned int)(region.width * scaledWidth));
+  cropWidth = std::min(cropWidth, scaledWidth - std::min(left, scaledWidth - 1));
+  const JDIMENSION top = std::min((unsigned int)(region.top * scaledHeight), scaledHeight - 1);
+  JDIMENSION cropHeight = std::max(1u, (unsigned int)(region.height * scaledHeight));
+  cropHeight = std::min(cropHeight, scaledHeight - top);
+
+  if(left > 0 || cropWidth < scaledWidth) {
+    // Updates left and cropWidth (and output_width) to iMCU boundaries.
+    jpeg_crop_scanline(&cinfo, &left, &cropWidth);
+  }
 
-  unsigned int desiredOutputBufferLen =
-    cinfo.image_width * cinfo.image_height * cinfo.num_components;
+  width = cinfo.output_width;
+  height = cropHeight;
+  unsigned int row_stride = cinfo.output_width * cinfo.output_components;
+
+  unsigned int desiredOutputBufferLen = row_stride * height;
   outputBuffer->resize(desiredOutputBufferLen);
 
+  if(top > 0) {
+    jpeg_skip_scanlines(&cinfo, top);
+  }
   uint8_t* ptr = ((uint8_t*)outputBuffer->start);
-  while (cinfo.output_scanline < cinfo.image_height){
+  while (cinfo.output_scanline < top + cropHeight){
     jpeg_read_scanlines(&cinfo, &ptr, 1);
     ptr += row_stride;
   }
+  if(cinfo.output_scanline < cinfo.output_height) {
+    jpeg_skip_scanlines(&cinfo, cinfo.output_height - cinfo.output_scanline);
+  }
 
   jpeg_finish_decompress(&cinfo);
   jpeg_destroy_decompress(&cinfo);
 }
+
+/* Binary PPM (P6) with a maxval of 255 or less. */
+static bool parsePpm(const uint8_t* data,
+                     size_t length,
+                     struct buffer<uint8_t>& rgb,
+                     unsigned int& width,
+                     unsigned int& height) {
+  size_t pos = 2;
+  unsigned int fields[3];
+  if(length < 2 || data[0] != 'P' || data[1] != '6') {
+    return false;
+  }
+  for(unsigned int f = 0; f < 3; f++) {
+    while(pos < length && (isspace(data[pos]) || data[pos] == '#')) {
+      if(data[pos] == '#') {
+        while(pos < length && data[pos] != '\n') {
+          pos++;
+        }
+      } else {
+        pos++;
+      }
+    }
+    if(pos >= length || !isdigit(data[pos])) {
+      return false;
+    }
+    fields[f] = 0;
+    while(pos < length && isdigit(data[pos])) {
+      fields[f] = fields[f] * 10 + (data[pos++] - '0');
+    }
+  }
+  pos++;  // Single whitespace before the raster.
+
+  width = fields[0];
+  height = fields[1];
+  const size_t size = (size_t)width * height * 3;
+  if(fields[2] == 0 || fields[2] > 255 || pos + size > length) {
+    return false;
+  }
+  rgb.resize(size);
+  memcpy(rgb.start, data + pos, size);
+  return true;
+}
+
+static bool hasImageExtension(const std::string& name) {
+  const size_t dot = name.rfind('.');
+  if(dot == std::string::npos) {
+    return false;
+  }
+  std::string extension = name.substr(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  return extension == "jpg" || extension == "jpeg" || extension == "ppm";
+}
+
+Sequence::Sequence(const char* path,
+                   struct buffer<uint8_t>& buffer_,
+                   bool loop_,
+                   unsigned int queueDepth_) :
+                      externalBuffer(&buffer_),
+                      loop(loop_),
+                      queueDepth(std::max(queueDepth_, 1u)) {
+  struct stat info;
+  if(stat(path, &info) < 0) {
+    errno_exit(path);
+  }
+  if(S_ISDIR(info.st_mode)) {
+    openDirectory(path);
+  } else {
+    openY4m(path);
+  }
+  std::cout << "Sequence " << path << " has " << frameCount() << " frames\n";
+
+  decodeThread = std::thread(&Sequence::decodeLoop, this);
+
+  // Peek at the first frame for the geometry.
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [this]{ return !decoded.empty() || finished; });
+  if(decoded.empty()) {
+    std::cout << "Could not decode any frame of: " << path << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  width = decoded.front().width;
+  height = decoded.front().height;
+  std::cout << "getImageProperties\t" << width << "," << height << std::endl;
+}
+
+Sequence::~Sequence() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    running = false;
+  }
+  changed.notify_all();
+  decodeThread.join();
+
+  for(Frame& frame : decoded) {
+    frame.rgb.destroy();
+  }
+  for(struct buffer<uint8_t>& rgb : spare) {
+    rgb.destroy();
+  }
+  if(stream != nullptr) {
+    munmap((void*)stream, streamLength);
+  }
+}
+
+int Sequence::grabFrame() {
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [this]{ return !decoded.empty() || finished; });
+  if(decoded.empty()) {
+    std::cout << "End of sequence" << std::endl;
+    return 0;
+  }
+
+  // Swap rather than copy. The decoder gets the old buffer back to reuse.
+  Frame frame = decoded.front();
+  decoded.pop_front();
+  spare.push_back(*externalBuffer);
+  *externalBuffer = frame.rgb;
+  width = frame.width;
+  height = frame.height;
+  changed.notify_all();
+  return externalBuffer->length;
+}
+
+size_t Sequence::frameCount() const {
+  return stream != nullptr ? frameOffsets.size() : files.size();
+}
+
+void Sequence::openDirectory(const char* path) {
+  DIR* dir = opendir(path);
+  if(dir == nullptr) {
+    errno_exit(path);
+  }
+  while(struct dirent* entry = readdir(dir)) {
+    if(hasImageExtension(entry->d_name)) {
+      files.push_back(std::string(path) + "/" + entry->d_name);
+    }
+  }
+  closedir(dir);
+  std::sort(files.begin(), files.end());
+}
+
+void Sequence::openY4m(const char* path) {
+  int file = open(path, O_RDONLY);
+  if(file < 0) {
+    errno_exit(path);
+  }
+  struct stat info;
+  fstat(file, &info);
+  streamLength = info.st_size;
+  void* mapped = mmap(NULL, streamLength, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if(mapped == MAP_FAILED) {
+    errno_exit("mmap");
+  }
+  stream = (const uint8_t*)mapped;
+  madvise(mapped, streamLength, MADV_SEQUENTIAL);
+
+  const uint8_t* end = stream + streamLength;
+  const uint8_t* lineEnd = std::find(stream, end, '\n');
+  const std::string header(stream, lineEnd);
+  if(header.compare(0, 10, "YUV4MPEG2 ") != 0 || lineEnd == end) {
+    std::cout << "Not a Y4M stream: " << path << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  size_t tokenStart = 10;
+  while(tokenStart < header.size()) {
+    size_t tokenEnd = header.find(' ', tokenStart);
+    if(tokenEnd == std::string::npos) {
+      tokenEnd = header.size();
+    }
+    const std::string token = header.substr(tokenStart, tokenEnd - tokenStart);
+    if(!token.empty() && token[0] == 'W') {
+      streamWidth = atoi(token.c_str() + 1);
+    } else if(!token.empty() && token[0] == 'H') {
+      streamHeight = atoi(token.c_str() + 1);
+    } else if(!token.empty() && token[0] == 'C') {
+      if(token.compare(0, 4, "C420") == 0) {
+        chromaShiftX = 1;
+        chromaShiftY = 1;
+      } else if(token == "C422") {
+        chromaShiftX = 1;
+        chromaShiftY = 0;
+      } else if(token == "C444") {
+        chromaShiftX = 0;
+        chromaShiftY = 0;
+      } else if(token == "Cmono") {
+        mono = true;
+      } else {
+        std::cout << "Unsupported Y4M colour space " << token << std::endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+    tokenStart = tokenEnd + 1;
+  }
+
+  const size_t chromaWidth = (streamWidth + (1 << chromaShiftX) - 1) >> chromaShiftX;
+  const size_t chromaHeight = (streamHeight + (1 << chromaShiftY) - 1) >> chromaShiftY;
+  const size_t frameSize = (size_t)streamWidth * streamHeight +
+    (mono ? 0 : 2 * chromaWidth * chromaHeight);
+
+  // Index every frame up front so decoding can seek straight to it.
+  const uint8_t* frame = lineEnd + 1;
+  while(frame + 5 <= end && memcmp(frame, "FRAME", 5) == 0) {
+    const uint8_t* data = std::find(frame, end, '\n') + 1;
+    if(data > end || data + frameSize > end) {
+      break;
+    }
+    frameOffsets.push_back(data - stream);
+    frame = data + frameSize;
+  }
+}
+
+bool Sequence::decodeFrame(size_t index, Frame& frame, JpegDecoder& decoder) {
+  if(stream != nullptr) {
+    const uint8_t* yPlane = stream + frameOffsets[index];
+    const size_t chromaSize =
+      ((streamWidth + (1 << chromaShiftX) - 1) >> chromaShiftX) *
+      ((streamHeight + (1 << chromaShiftY) - 1) >> chromaShiftY);
+    const uint8_t* uPlane = mono ? nullptr : yPlane + streamWidth * streamHeight;
+    const uint8_t* vPlane = mono ? nullptr : uPlane + chromaSize;
+
+    frame.width = streamWidth;
+    frame.height = streamHeight;
+    frame.rgb.resize(streamWidth * streamHeight * 3);
+    planarYuvToRgb(yPlane, uPlane, vPlane, frame.rgb.start,
+                   streamWidth, streamHeight, chromaShiftX, chromaShiftY);
+    return true;
+  }
+
+  const char* filename = files[index].c_str();
+  int file = open(filename, O_RDONLY);
+  if(file < 0) {
+    std::cout << "Could not read file: " << filename << std::endl;
+    return false;
+  }
+  struct stat info;
+  fstat(file, &info);
+  const size_t length = info.st_size;
+  void* mapped = length ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+  close(file);
+  if(mapped == MAP_FAILED) {
+    std::cout << "Could not map file: " << filename << std::endl;
+    return false;
+  }
+
+  const uint8_t* data = (const uint8_t*)mapped;
+  bool decoded;
+  if(length > 2 && data[0] == 0xff && data[1] == 0xd8) {
+    decoded = decoder.decode(data, length, frame.rgb, frame.width, frame.height);
+  } else {
+    decoded = parsePpm(data, length, frame.rgb, frame.width, frame.height);
+  }
+  munmap(mapped, length);
+
+  if(!decoded) {
+    std::cout << "Could not decode file: " << filename << std::endl;
+  }
+  return decoded;
+}
+
+void Sequence::decodeLoop() {
+  JpegDecoder decoder;
+  size_t failures = 0;
+
+  std::unique_lock<std::mutex> guard(lock);
+  while(true) {
+    changed.wait(guard, [this]{ return !running || decoded.size() < queueDepth; });
+    if(!running) {
+      break;
+    }
+    if(position >= frameCount()) {
+      position = 0;
+      if(!loop) {
+        break;
+      }
+    }
+    if(failures >= frameCount()) {
+      // Nothing left that will decode.
+      break;
+    }
+
+    Frame frame;
+    if(!spare.empty()) {
+      frame.rgb = spare.back();
+      spare.pop_back();
+    }
+    const size_t index = position++;
+
+    guard.unlock();
+    const bool ok = decodeFrame(index, frame, decoder);
+    guard.lock();
+
+    if(ok) {
+      failures = 0;
+      decoded.push_back(frame);
+      changed.notify_all();
+    } else {
+      failures++;
+      spare.push_back(frame.rgb);
+    }
+  }
+
+  finished = true;
+  changed.notify_all();
+}
+
+Replay::Replay(const char* filename,
+               struct buffer<uint8_t>& buffer_,
+               bool realTime_,
+               bool loop_) :
+                  externalBuffer(&buffer_),
+                  realTime(realTime_),
+                  loop(loop_) {
+  int file = open(filename, O_RDONLY);
+  if(file < 0) {
+    errno_exit(filename);
+  }
+  struct stat info;
+  fstat(file, &info);
+  mappingLength = info.st_size;
+  void* mapped = mmap(NULL, mappingLength, PROT_READ, MAP_SHARED, file, 0);
+  close(file);
+  if(mapped == MAP_FAILED || mappingLength < sizeof(RecordingHeader)) {
+    errno_exit("mmap");
+  }
+  mapping = (const uint8_t*)mapped;
+  header = (const RecordingHeader*)mapping;
+  index = (const RecordingIndex*)(mapping + sizeof(RecordingHeader));
+
+  if(header->magic != RECORDING_MAGIC || header->version != RECORDING_VERSION) {
+    std::cout << "Not a recording: " << filename << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  // Nothing past here trusts the header, so a corrupt or truncated file
+  // can't send a read outside the mapping. Index entries are checked as
+  // each frame is read.
+  const uint64_t indexEnd = sizeof(RecordingHeader) +
+    std::min<uint64_t>(header->maxFrames, mappingLength) * sizeof(RecordingIndex);
+  const uint64_t rowBytes = (uint64_t)header->width *
+    (header->pixelFormat == PIXEL_FORMAT_RGB24 ? 3 : 2);
+  if(header->width == 0 || header->height == 0 ||
+     header->width > 0xffff || header->height > 0xffff ||
+     header->pixelFormat > PIXEL_FORMAT_MJPEG ||
+     (header->pixelFormat != PIXEL_FORMAT_MJPEG && header->bytesPerLine < rowBytes) ||
+     indexEnd > mappingLength || header->dataOffset < indexEnd ||
+     header->dataOffset > mappingLength) {
+    std::cout << "Corrupt recording: " << filename << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  width = header->width;
+  height = header->height;
+  if(header->pixelFormat == PIXEL_FORMAT_MJPEG) {
+    decoder = new JpegDecoder();
+  }
+  std::cout << "Replaying " << frameCount() << " frames from " << filename << "\n";
+  std::cout << "getImageProperties\t" << width << "," << height << std::endl;
+}
+
+Replay::~Replay() {
+  delete decoder;
+  munmap((void*)mapping, mappingLength);
+}
+
+size_t Replay::frameCount() const {
+  // The file may still be growing if a Recorder is writing it.
+  const uint64_t written = __atomic_load_n(&header->frameCount, __ATOMIC_ACQUIRE);
+  return std::min(written, header->maxFrames);
+}
+
+void Replay::seek(size_t frameIndex) {
+  position = frameIndex;
+  clockStarted = false;
+}
+
+bool Replay::readFrame(const RecordingIndex& entry) {
+  // The frame has to lie inside the data area, which a truncated file may
+  // not entirely have, and hold a whole image.
+  const uint64_t available =
+    std::min<uint64_t>(header->dataBytes, mappingLength - header->dataOffset);
+  if(entry.offset > available || entry.length > available - entry.offset) {
+    return false;
+  }
+  const uint8_t* data = mapping + header->dataOffset + entry.offset;
+  const size_t stride = header->bytesPerLine;
+  const size_t rgbBytes = (size_t)width * height * 3;
+  unsigned int decodedWidth;
+  unsigned int decodedHeight;
+
+  switch (header->pixelFormat) {
+    case PIXEL_FORMAT_RGB24:
+      if(entry.length < (height - 1) * stride + width * 3) {
+        return false;
+      }
+      externalBuffer->resize(rgbBytes);
+      for(unsigned int y = 0; y < height; y++) {
+        memcpy(externalBuffer->start + (size_t)y * width * 3, data + y * stride, width * 3);
+      }
+      return true;
+    case PIXEL_FORMAT_YUYV:
+      if(entry.length < (height - 1) * stride + width * 2) {
+        return false;
+      }
+      externalBuffer->resize(rgbBytes);
+      yuyvToRgb(data, stride, externalBuffer->start, width, height);
+      return true;
+    case PIXEL_FORMAT_MJPEG:
+      // The pipeline is sized for the recording, so a frame the camera
+      // encoded at any other size can't be used.
+      return decoder->decode(data, entry.length, *externalBuffer,
+                             decodedWidth, decodedHeight) &&
+             decodedWidth == width && decodedHeight == height;
+  }
+  return false;
+}
+
+int Replay::grabFrame() {
+  size_t skipped = 0;
+  while(true) {
+    if(position >= frameCount()) {
+      if(!loop || frameCount() == 0) {
+        std::cout << "End of recording" << std::endl;
+        return 0;
+      }
+      seek(0);
+    }
+    if(readFrame(index[position])) {
+      break;
+    }
+    std::cout << "Skipping corrupt frame " << position << std::endl;
+    position++;
+    if(++skipped >= frameCount()) {
+      std::cout << "No readable frames" << std::endl;
+      return 0;
+    }
+  }
+
+  const RecordingIndex& entry = index[position];
+  if(realTime) {
+    // Hold each frame back until the same time has passed as when recorded.
+    if(!clockStarted) {
+      clockStarted = true;
+      clockStart = std::chrono::steady_clock::now();
+      clockStartUs = entry.timestampUs;
+    }
+    std::this_thread::sleep_until(
+        clockStart + std::chrono::microseconds(entry.timestampUs - clockStartUs));
+  }
+
+  timestamp.tv_sec = entry.timestampUs / 1000000;
+  timestamp.tv_usec = entry.timestampUs % 1000000;
+  position++;
+  return externalBuffer->length;
+}
+
+Synthetic::Synthetic(struct buffer<uint8_t>& buffer_,
+                     unsigned int width_,
+                     unsigned int height_,
+                     unsigned int noise_,
+                     uint64_t seed) :
+    externalBuffer(&buffer_), noise(noise_), random(seed ? seed : 1) {
+  width = width_;
+  height = height_;
+  // Keep edges roughly the same weight whatever the resolution.
+  thickness = std::max(1u, std::min(width, height) / 160);
+  externalBuffer->resize(width * height * 3);
+}
+
+int Synthetic::grabFrame() {
+  // Run on a virtual 30fps clock so results don't depend on the host.
+  const uint64_t frameUs = frame * 1000000 / 30;
+  timestamp.tv_sec = frameUs / 1000000;
+  timestamp.tv_usec = frameUs % 1000000;
+
+  externalBuffer->resize(width * height * 3);
+  memset(externalBuffer->start, 96, externalBuffer->length);
+  groundTruth.clear();
+
+  // Everything is laid out in fractions of the frame then scaled to fit.
+  const double w = width;
+  const double h = height;
+  const Segment fixed[] = {
+    {0.05 * w, 0.10 * h, 0.95 * w, 0.10 * h, 255, 64, 64},
+    {0.08 * w, 0.20 * h, 0.08 * w, 0.90 * h, 64, 255, 64},
+    {0.15 * w, 0.90 * h, 0.45 * w, 0.25 * h, 64, 64, 255},
+    // Triangle.
+    {0.55 * w, 0.30 * h, 0.90 * w, 0.30 * h, 255, 255, 255},
+    {0.90 * w, 0.30 * h, 0.72 * w, 0.75 * h, 255, 255, 255},
+    {0.72 * w, 0.75 * h, 0.55 * w, 0.30 * h, 255, 255, 255},
+  };
+  for(const Segment& segment : fixed) {
+    drawSegment(segment);
+    addGroundTruth(segment);
+  }
+
+  // A segment spinning about its centre at 2 degrees per frame.
+  const double angle = M_PI * (frame % 180) / 90;
+  const double length = 0.15 * std::min(w, h);
+  const double cx = 0.30 * w;
+  const double cy = 0.65 * h;
+  const Segment spinner = {cx - length * cos(angle), cy - length * sin(angle),
+                           cx + length * cos(angle), cy + length * sin(angle),
+                           255, 255, 0};
+  drawSegment(spinner);
+  addGroundTruth(spinner);
+
+  // A disc sliding back and forth along the bottom. No straight edges.
+  const double sweep = (frame % 120) / 60.0;
+  const double position = sweep < 1 ? sweep : 2 - sweep;
+  drawDisc((0.55 + 0.35 * position) * w, 0.88 * h, 0.05 * std::min(w, h), 255, 0, 255);
+
+  if(noise) {
+    uint8_t* pixel = externalBuffer->start;
+    uint8_t* end = pixel + externalBuffer->length;
+    for(; pixel < end; pixel++) {
+      // xorshift64. Cheap and repeatable for a given seed.
+      random ^= random << 13;
+      random ^= random >> 7;
+      random ^= random << 17;
+      const int value = *pixel + (int)(random % (2 * noise + 1)) - (int)noise;
+      *pixel = std::max(0, std::min(255, value));
+    }
+  }
+
+  frame++;
+  return externalBuffer->length;
+}
+
+void Synthetic::drawSegment(const Segment& segment) {
+  const double dx = segment.x1 - segment.x0;
+  const double dy = segment.y1 - segment.y0;
+  const int steps = std::max(1, (int)ceil(std::max(fabs(dx), fabs(dy))));
+  const int low = -(int)(thickness / 2);
+  const int high = low + (int)thickness;
+
+  for(int step = 0; step <= steps; step++) {
+    const int x = lround(segment.x0 + dx * step / steps);
+    const int y = lround(segment.y0 + dy * step / steps);
+    for(int by = y + low; by < y + high; by++) {
+      for(int bx = x + low; bx < x + high; bx++) {
+        if(bx < 0 || by < 0 || bx >= (int)width || by >= (int)height) {
+          continue;
+        }
+        uint8_t* pixel = &externalBuffer->start[(bx + by * width) * 3];
+        pixel[0] = segment.r;
+        pixel[1] = segment.g;
+        pixel[2] = segment.b;
+      }
+    }
+  }
+}
+
+void Synthetic::drawDisc(double cx, double cy, double radius,
+                         uint8_t r, uint8_t g, uint8_t b) {
+  const int top = std::max(0, (int)floor(cy - radius));
+  const int bottom = std::min((int)height - 1, (int)ceil(cy + radius));
+  const int left = std::max(0, (int)floor(cx - radius));
+  const int right = std::min((int)width - 1, (int)ceil(cx + radius));
+
+  for(int y = top; y <= bottom; y++) {
+    for(int x = left; x <= right; x++) {
+      if((x - cx) * (x - cx) + (y - cy) * (y - cy) <= radius * radius) {
+        uint8_t* pixel = &externalBuffer->start[(x + y * width) * 3];
+        pixel[0] = r;
+        pixel[1] = g;
+        pixel[2] = b;
+      }
+    }
+  }
+}
+
+void Synthetic::addGroundTruth(const Segment& segment) {
+  // Same parametrisation as HoughTransform in hough.h: r = x cos(a) +
+  // y sin(a) where a is the angle of the line's normal. Folded so a lies in
+  // [-HOUGH_ANGLES / 2, HOUGH_ANGLES / 2), which is [-90, 90).
+  double a = atan2(segment.x1 - segment.x0, -(segment.y1 - segment.y0)) * 180 / M_PI;
+  if(a >= 90) {
+    a -= 180;
+  } else if(a < -90) {
+    a += 180;
+  }
+  long angle = lround(a);
+  if(angle == 90) {
+    angle = -90;
+  }
+  const double radians = M_PI * angle / 180;
+  const double r = segment.x0 * cos(radians) + segment.y0 * sin(radians);
+  struct polarCoord coord;
+  coord.r = lround(r);
+  coord.a = angle;
+  groundTruth.push_back(coord);
+}
@@ -12,6 +12,8 @@
 #include <errno.h>
 #include <linux/videodev2.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/stat.h>
 #include <assert.h>
 #include <SDL/SDL.h>
 #include <SDL/SDL_image.h>
@@ -20,43 +22,211 @@
 #include <algorithm>
 #include <linux/videodev2.h>
 #include <libv4l2.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <chrono>
+#include <string>
+#include <map>
+#include <memory>
 
 #include "types.h"
+#include "convert.h"
 
 enum IoMethod {
         IO_METHOD_READ,
         IO_METHOD_MMAP_SINGLE,
         IO_METHOD_MMAP_DOUBLE,
+        IO_METHOD_MMAP_RING,
+        IO_METHOD_USERPTR,     // Driver fills page aligned buffers we allocate. Else IO_METHOD_MMAP_RING.
+};
+
+/* Pixel format requested from the driver. Falls back to RGB24 if the device
+ * can't capture it. */
+enum PixelFormat {
+        PIXEL_FORMAT_RGB24,  // Converted by libv4l2 if the device can't do it natively.
+        PIXEL_FORMAT_YUYV,   // Native on most UVC cameras. We convert it ourselves.
+        PIXEL_FORMAT_MJPEG,  // Needed for full frame rate at high resolution over USB.
+};
+
+/* What the capture thread does when every buffer it could hand back to the
+ * driver is waiting for the consumer. */
+enum DropPolicy {
+        DROP_POLICY_OLDEST,  // Recycle the oldest unread frame. grabFrame() gets the newest.
+        DROP_POLICY_BLOCK,   // Stop dequeuing until the consumer catches up. Frames come out in order.
+};
+
+struct CaptureStats {
+  std::atomic<uint64_t> captured{0};       // Frames dequeued from the driver.
+  std::atomic<uint64_t> dropped{0};        // Frames recycled by DROP_POLICY_OLDEST before being read.
+  std::atomic<uint64_t> driverDropped{0};  // Gaps in the driver's sequence numbers.
+  std::atomic<uint64_t> stale{0};          // Frames skipped because a newer one was ready.
+  std::atomic<uint64_t> rejected{0};       // Decoded MJPEG frames not the capture size.
+};
+
+/* A captured frame on loan from a Camera. The buffer is kept out of the
+ * driver's queue, so it can be read and written in place, until it is handed
+ * back with Camera::releaseFrame(). */
+struct FrameLease {
+  uint8_t* start = nullptr;
+  size_t length = 0;    // Bytes of image data in start.
+  int index = -1;       // Driver buffer index. -1 when nothing is leased.
+  uint32_t sequence = 0;
+  struct timeval timestamp = {0, 0};
+};
+
+/* Decodes JPEG frames to RGB24 on a pool of worker threads. Each worker keeps
+ * one libjpeg decompressor for its whole life. Frames come out of collect() in
+ * the order they went into submit(), however the workers finish. */
+class JpegDecodePool {
+  struct Slot {
+    std::vector<uint8_t> compressed;
+    struct buffer<uint8_t> rgb = {0};
+    unsigned int width = 0;
+    unsigned int height = 0;
+    uint32_t sequence = 0;
+    struct timeval timestamp = {0, 0};
+    uint64_t order = 0;  // Position in the order frames were submitted.
+    enum { FREE, QUEUED, DECODING, DONE, FAILED } state = FREE;
+  };
+
+  std::vector<Slot> slots;
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable changed;
+  uint64_t nextIn = 0;
+  bool running = true;
+
+ public:
+  JpegDecodePool(unsigned int numWorkers, unsigned int maxInFlight);
+  ~JpegDecodePool();
+
+  /* Queue a compressed frame. The data is copied, so the caller may reuse its
+   * buffer as soon as this returns. If maxInFlight frames are already queued
+   * this waits up to timeoutMs for room. If none came and evictOldest is set,
+   * the oldest frame that is not being decoded makes room and is counted in
+   * evicted, otherwise this returns false. */
+  bool submit(const uint8_t* data,
+              size_t length,
+              uint32_t sequence,
+              const struct timeval& timestamp,
+              unsigned int timeoutMs,
+              bool evictOldest,
+              uint64_t& evicted);
+
+  /* Wait up to timeoutMs for the next frame and swap it into rgb. With newest
+   * set, any later frames that are also finished are skipped to and the count
+   * skipped is added to skipped. Corrupt frames are skipped silently. */
+  bool collect(struct buffer<uint8_t>& rgb,
+               unsigned int& width,
+               unsigned int& height,
+               uint32_t& sequence,
+               struct timeval& timestamp,
+               bool newest,
+               unsigned int timeoutMs,
+               uint64_t& skipped);
+
+ private:
+  /* The earliest submitted slot in one of the states of mask, a bit per
+   * state, or nullptr. */
+  Slot* oldest(unsigned int mask);
+  void worker();
 };
 
 void errno_exit(const char *s);
 
-class Camera {
+struct JpegDecoder;
+class Recorder;
+
+/* Anything main() can pull frames from. grabFrame() puts the next RGB24
+ * frame of width * height pixels in the buffer the source was built with and
+ * returns 0 when there are no more. */
+class FrameSource {
+ public:
+  unsigned int width = 0;
+  unsigned int height = 0;
+  struct timeval timestamp = {0, 0};  // Capture time of the last frame.
+
+  virtual ~FrameSource() {}
+
+  virtual int grabFrame() = 0;
+};
+
+class Camera : public FrameSource {
   int fd;
   const char* deviceName;
   enum IoMethod io;
   int captureWidth = 0;
   int captureHeight = 0;
   unsigned int numBuffers;
+  unsigned int ringSize;
+  enum DropPolicy policy;
+  enum PixelFormat pixelFormat;
+  size_t bytesPerLine = 0;
+  size_t imageSize = 0;
+  struct buffer<uint8_t> rgbBuffer = {0};  // Conversion target for non RGB24 formats.
+  JpegDecodePool* decodePool = nullptr;    // Only in PIXEL_FORMAT_MJPEG mode.
+  std::atomic<Recorder*> recorder{nullptr};
   void** cameraBuffer;
   size_t* bufferLength;
-  struct buffer<uint8_t> buffers[2];
+  std::vector<struct buffer<uint8_t>> buffers;
 	struct v4l2_format format;
-  struct v4l2_buffer bufferinfo;
   int imageformat;
 
+  // Capture thread state. Every buffer is in exactly one place: queued with
+  // the driver, in "ready" (dequeued, oldest first) or out on a FrameLease.
+  // With IO_METHOD_READ there is no driver queue; "freeBuffers" stands in for
+  // it and "inDriver" counts the buffers there.
+  std::thread captureThread;
+  std::mutex readyLock;
+  std::condition_variable readyCondition;
+  std::deque<FrameLease> ready;
+  std::deque<unsigned int> freeBuffers;
+  uint32_t readSequence = 0;
+  unsigned int inDriver = 0;
+  unsigned int leased = 0;  // Frames out on a FrameLease. None by stopCapture().
+  FrameLease grabbed;  // The lease backing grabFrame().
+  std::atomic<bool> running{false};
+  bool haveSequence = false;
+  uint32_t lastSequence = 0;
+
  public:
-  unsigned int width;
-  unsigned int height;
+  CaptureStats stats;
 
 	Camera(const char* deviceName_,
          enum IoMethod io_,
          void** cameraBuffer_,
-         size_t* bufferLength_);
+         size_t* bufferLength_,
+         unsigned int ringSize_ = 4,
+         enum DropPolicy policy_ = DROP_POLICY_OLDEST,
+         enum PixelFormat pixelFormat_ = PIXEL_FORMAT_RGB24);
 
   ~Camera();
 
-  int grabFrame();
+  /* Put the next RGB24 frame in cameraBuffer and bufferLength.
+   * In RGB24 mode this is the leased driver buffer itself; it is released on
+   * the following call. Other formats are converted into a buffer we own. */
+  int grabFrame() override;
+
+  /* Put just the intensity of the next frame in lumaBuffer, skipping colour
+   * conversion. Only available in PIXEL_FORMAT_YUYV mode. */
+  int grabLuma(struct buffer<uint8_t>& lumaBuffer);
+
+  /* Lease the next frame. Waits up to timeoutMs for one to arrive and returns
+   * false if none did. The frame must be returned with releaseFrame().
+   * Not available in PIXEL_FORMAT_MJPEG mode, where frames go straight from
+   * the capture thread to the decode pool. */
+  bool acquireFrame(FrameLease& lease, unsigned int timeoutMs = 2000);
+
+  /* Give a leased frame back to the driver. The lease is emptied. */
+  void releaseFrame(FrameLease& lease);
+
+  /* Stream every frame from here on into a recording of up to byteBudget
+   * bytes, as the driver delivered it and before any conversion. Frames are
+   * copied on the capture thread, so grabFrame() never waits for them. */
+  void startRecording(const char* filename, size_t byteBudget);
 
  private:
   void checkCapabilities();
@@ -69,29 +239,209 @@ class Camera {
   void setControl(int id, int value);
 
   void initMmap(unsigned int numBuffers_);
+  void initUserptr(unsigned int numBuffers_);
+  void initRead(unsigned int numBuffers_);
 
   void prepareBuffer();
+
+  int grabDecoded();
+
+  void startCapture();
+  void stopCapture();
+  void captureLoop();
+  bool dequeueFrame(FrameLease& frame);
+  void queueBuffer(unsigned int index);
 };
 
 
-class File {
+/* Which part of a JPEG to decode and at what scale. Scaling happens in the
+ * DCT domain and skipped rows and columns are never decoded, so decode cost
+ * follows the size of the output. */
+struct JpegRegion {
+  unsigned int scale = 8;  // Output is scale/8 of full size, 1 to 8.
+  // Fractions of the scaled image. Columns get widened out to the nearest
+  // iMCU boundary by libjpeg.
+  double left = 0;
+  double top = 0;
+  double width = 1;
+  double height = 1;
+
+  bool operator==(const JpegRegion& rhs) const {
+    return scale == rhs.scale && left == rhs.left && top == rhs.top &&
+      width == rhs.width && height == rhs.height;
+  }
+};
+
+/* An image decoded once and shared by every File reading the same path. */
+struct DecodedImage {
+  struct buffer<uint8_t> rgb = {0};
+  unsigned int width = 0;
+  unsigned int height = 0;
+  JpegRegion region;
+  struct timespec mtime = {0, 0};
+  off_t size = 0;
+
+  ~DecodedImage() {
+    rgb.destroy();
+  }
+};
+
+class File : public FrameSource {
   const char* filename;
   struct buffer<uint8_t> internalBuffer;
   struct buffer<uint8_t>* externalBuffer;
+  std::shared_ptr<const DecodedImage> decoded;
 
  public:
-  unsigned int width;
-  unsigned int height;
-
   File(const char* filename_, struct buffer<uint8_t>& buffer_);
   ~File();
-  int grabFrame();
+
+  /* Copy the decoded image into the buffer given to the constructor. The
+   * file is only read and decoded again when its mtime or size changes, or
+   * the scale or region in config.fileDecode does. */
+  int grabFrame() override;
  private:
   void getImageProperties();
+  std::shared_ptr<const DecodedImage> decodeFile(const struct stat& info,
+                                                 const JpegRegion& region);
   void parseJpeg(struct buffer<uint8_t>* inputBuffer,
                  struct buffer<uint8_t>* outputBuffer,
                  unsigned int& width,
-                 unsigned int& height);
+                 unsigned int& height,
+                 const JpegRegion& region);
+};
+
+
+/* Plays back a directory of JPEG and binary PPM images, in file name order,
+ * or a Y4M stream. Inputs are mmapped and decoded ahead on a background
+ * thread into a queue of queueDepth frames, so benchmark runs measure the
+ * pipeline rather than the disk and the decoder. */
+class Sequence : public FrameSource {
+  struct Frame {
+    struct buffer<uint8_t> rgb = {0};
+    unsigned int width = 0;
+    unsigned int height = 0;
+  };
+
+  struct buffer<uint8_t>* externalBuffer;
+  bool loop;
+  unsigned int queueDepth;
+
+  // Image directory mode.
+  std::vector<std::string> files;
+
+  // Y4M mode. The whole stream stays mapped; frameOffsets index the pixel
+  // data of each frame.
+  const uint8_t* stream = nullptr;
+  size_t streamLength = 0;
+  std::vector<size_t> frameOffsets;
+  unsigned int streamWidth = 0;
+  unsigned int streamHeight = 0;
+  unsigned int chromaShiftX = 1;
+  unsigned int chromaShiftY = 1;
+  bool mono = false;
+
+  size_t position = 0;
+  std::thread decodeThread;
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<Frame> decoded;
+  std::vector<struct buffer<uint8_t>> spare;
+  bool running = true;
+  bool finished = false;
+
+ public:
+  Sequence(const char* path,
+           struct buffer<uint8_t>& buffer_,
+           bool loop_ = false,
+           unsigned int queueDepth_ = 4);
+  ~Sequence();
+
+  /* Swap the next decoded frame into the buffer given to the constructor.
+   * Returns 0 once the sequence has ended and loop is off. */
+  int grabFrame() override;
+
+  size_t frameCount() const;
+
+ private:
+  void openDirectory(const char* path);
+  void openY4m(const char* path);
+  bool decodeFrame(size_t index, Frame& frame, JpegDecoder& decoder);
+  void decodeLoop();
+};
+
+
+/* Plays back a segment file written by Recorder, converting or decoding each
+ * frame to RGB24. Frames can be fetched in any order with seek(). grabFrame()
+ * either keeps to the recorded timing or, with realTime off, runs flat out. */
+class Replay : public FrameSource {
+  struct buffer<uint8_t>* externalBuffer;
+  bool realTime;
+  bool loop;
+  const uint8_t* mapping = nullptr;
+  size_t mappingLength = 0;
+  const RecordingHeader* header = nullptr;
+  const RecordingIndex* index = nullptr;
+  JpegDecoder* decoder = nullptr;  // Only for MJPEG recordings.
+  size_t position = 0;
+  bool clockStarted = false;
+  std::chrono::steady_clock::time_point clockStart;
+  int64_t clockStartUs = 0;
+
+ public:
+  Replay(const char* filename,
+         struct buffer<uint8_t>& buffer_,
+         bool realTime_ = false,
+         bool loop_ = false);
+  ~Replay();
+
+  /* Copy the next frame into the buffer given to the constructor. Returns 0
+   * at the end of the recording unless loop is set. */
+  int grabFrame() override;
+
+  /* Make frameIndex the next frame grabFrame() returns. */
+  void seek(size_t frameIndex);
+
+  size_t frameCount() const;
+
+ private:
+  /* Convert or decode a recorded frame into the buffer. Returns false if
+   * the entry doesn't hold a whole image. */
+  bool readFrame(const RecordingIndex& entry);
+};
+
+
+/* Renders test scenes at any resolution: coloured lines, triangles and a
+ * moving line and disc over a grey background, plus optional noise. The
+ * true polar parameters of every straight edge in the last frame are kept
+ * in groundTruth so detectors can be scored. Needs no camera or assets. */
+class Synthetic : public FrameSource {
+  struct Segment {
+    double x0, y0, x1, y1;
+    uint8_t r, g, b;
+  };
+
+  struct buffer<uint8_t>* externalBuffer;
+  unsigned int noise;
+  unsigned int thickness;
+  uint64_t frame = 0;
+  uint64_t random;
+
+ public:
+  std::vector<struct polarCoord> groundTruth;
+
+  Synthetic(struct buffer<uint8_t>& buffer_,
+            unsigned int width_,
+            unsigned int height_,
+            unsigned int noise_ = 8,
+            uint64_t seed = 1);
+
+  int grabFrame() override;
+
+ private:
+  void drawSegment(const Segment& segment);
+  void drawDisc(double cx, double cy, double radius, uint8_t r, uint8_t g, uint8_t b);
+  void addGroundTruth(const Segment& segment);
 };
 
 
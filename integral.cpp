@@ -0,0 +1,195 @@
+#include "integral.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WAZAT_X86
+#endif
+
+/* Each table row is the running sum along the sample row added to the table
+ * row above. out and above point at column 1, past the zero column. */
+static void integrateRowScalar(const uint8_t* samples,
+                               const unsigned int step,
+                               const uint32_t* above,
+                               uint32_t* out,
+                               const unsigned int start,
+                               const unsigned int width,
+                               uint32_t run) {
+  for(unsigned int x = start; x < width; x++) {
+    run += samples[x * step];
+    out[x] = above[x] + run;
+  }
+}
+
+#ifdef WAZAT_X86
+
+/* Inclusive prefix sum of the four lanes of v, plus carry in every lane. */
+__attribute__((target("sse2")))
+static inline __m128i prefixSum(__m128i v, const __m128i carry) {
+  v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+  v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+  return _mm_add_epi32(v, carry);
+}
+
+/* Add sixteen 8 bit samples into out, a running sum carried in every lane
+ * of carry on top of the table row above. */
+__attribute__((target("sse2")))
+static inline void integrate16(const __m128i bytes,
+                               const uint32_t* above,
+                               uint32_t* out,
+                               __m128i& carry) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i low = _mm_unpacklo_epi8(bytes, zero);
+  const __m128i high = _mm_unpackhi_epi8(bytes, zero);
+  const __m128i words[4] = {
+    _mm_unpacklo_epi16(low, zero), _mm_unpackhi_epi16(low, zero),
+    _mm_unpacklo_epi16(high, zero), _mm_unpackhi_epi16(high, zero)
+  };
+  for(int part = 0; part < 4; part++) {
+    const __m128i sums = prefixSum(words[part], carry);
+    carry = _mm_shuffle_epi32(sums, 0xff);
+    _mm_storeu_si128((__m128i*)(out + part * 4), _mm_add_epi32(
+        sums, _mm_loadu_si128((const __m128i*)(above + part * 4))));
+  }
+}
+
+/* Contiguous samples. Sixteen at a time, widened to four vectors of 32 bit
+ * lanes, each prefix summed in register and carried into the next. */
+__attribute__((target("sse2")))
+static void integrateRowSse2(const uint8_t* samples,
+                             const uint32_t* above,
+                             uint32_t* out,
+                             const unsigned int width) {
+  __m128i carry = _mm_setzero_si128();
+  unsigned int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    integrate16(_mm_loadu_si128((const __m128i*)(samples + x)), above + x, out + x, carry);
+  }
+  integrateRowScalar(samples, 1, above, out, x, width, _mm_cvtsi128_si32(carry));
+}
+
+/* One channel of RGB24. Sixteen pixels are shuffled out of three loads and
+ * then summed as above. Stops a pixel early so the last load can't run past
+ * the end of the row whichever channel samples starts at. */
+__attribute__((target("ssse3")))
+static void integrateRowRgbSsse3(const uint8_t* samples,
+                                 const uint32_t* above,
+                                 uint32_t* out,
+                                 const unsigned int width) {
+  const __m128i first = _mm_setr_epi8(
+      0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128);
+  const __m128i second = _mm_setr_epi8(
+      -128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14, -128, -128, -128, -128, -128);
+  const __m128i third = _mm_setr_epi8(
+      -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 1, 4, 7, 10, 13);
+  __m128i carry = _mm_setzero_si128();
+  unsigned int x = 0;
+  for(; x + 17 <= width; x += 16) {
+    const uint8_t* in = samples + 3 * x;
+    const __m128i bytes = _mm_or_si128(
+        _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), first),
+                     _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 16)), second)),
+        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 32)), third));
+    integrate16(bytes, above + x, out + x, carry);
+  }
+  integrateRowScalar(samples, 3, above, out, x, width, _mm_cvtsi128_si32(carry));
+}
+
+/* Set pixels of a feature map row, sixteen at a time. Each lane picks its
+ * bit out of a broadcast byte of the row. */
+__attribute__((target("sse2")))
+static void integrateRowBitsSse2(const uint64_t* bits,
+                                 const uint32_t* above,
+                                 uint32_t* out,
+                                 const unsigned int width) {
+  const __m128i lanes = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                      1, 2, 4, 8, 16, 32, 64, -128);
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i carry = _mm_setzero_si128();
+  unsigned int x = 0;
+  for(; x + 16 <= width; x += 16) {
+    // The first byte in the low eight lanes, the second in the high eight.
+    __m128i halves = _mm_cvtsi32_si128((uint16_t)(bits[x >> 6] >> (x & 63)));
+    halves = _mm_unpacklo_epi8(halves, halves);
+    halves = _mm_unpacklo_epi16(halves, halves);
+    halves = _mm_unpacklo_epi32(halves, halves);
+    const __m128i set = _mm_and_si128(
+        _mm_cmpeq_epi8(_mm_and_si128(halves, lanes), lanes), one);
+    integrate16(set, above + x, out + x, carry);
+  }
+  uint32_t run = _mm_cvtsi128_si32(carry);
+  for(; x < width; x++) {
+    run += (bits[x >> 6] >> (x & 63)) & 1;
+    out[x] = above[x] + run;
+  }
+}
+
+#endif  // WAZAT_X86
+
+#ifdef WAZAT_X86
+static const bool haveSsse3 = [] {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("ssse3");
+}();
+#endif
+
+void IntegralImage::build(const uint8_t* samples,
+                          const unsigned int width_,
+                          const unsigned int height_,
+                          const size_t stride,
+                          const unsigned int step) {
+  width = width_;
+  height = height_;
+  const size_t rowLength = width + 1;
+  table.resize(rowLength * (height + 1));
+  memset(table.start, 0, rowLength * sizeof(uint32_t));
+
+  for(unsigned int y = 0; y < height; y++) {
+    const uint8_t* row = samples + y * stride;
+    const uint32_t* above = table.start + y * rowLength + 1;
+    uint32_t* out = table.start + (y + 1) * rowLength + 1;
+    out[-1] = 0;
+#ifdef WAZAT_X86
+    if(step == 3 && haveSsse3) {
+      integrateRowRgbSsse3(row, above, out, width);
+      continue;
+    }
+    if(step != 1) {
+      // Gathering the channel first has no carried dependency, unlike the
+      // running sum, so it's cheaper than summing at a stride.
+      gathered.resize(width);
+      uint8_t* channel = gathered.start;
+      for(unsigned int x = 0; x < width; x++) {
+        channel[x] = row[x * step];
+      }
+      row = channel;
+    }
+    integrateRowSse2(row, above, out, width);
+#else
+    integrateRowScalar(row, step, above, out, 0, width, 0);
+#endif
+  }
+}
+
+void IntegralImage::build(const FeatureMap& map) {
+  width = map.width;
+  height = map.height;
+  const size_t rowLength = width + 1;
+  table.resize(rowLength * (height + 1));
+  memset(table.start, 0, rowLength * sizeof(uint32_t));
+
+  for(unsigned int y = 0; y < height; y++) {
+    const uint64_t* bits = map.row(y);
+    const uint32_t* above = table.start + y * rowLength + 1;
+    uint32_t* out = table.start + (y + 1) * rowLength + 1;
+    out[-1] = 0;
+#ifdef WAZAT_X86
+    integrateRowBitsSse2(bits, above, out, width);
+#else
+    uint32_t run = 0;
+    for(unsigned int x = 0; x < width; x++) {
+      run += (bits[x >> 6] >> (x & 63)) & 1;
+      out[x] = above[x] + run;
+    }
+#endif
+  }
+}
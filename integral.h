@@ -0,0 +1,76 @@
+#ifndef WAZAT_INTEGRAL_H
+#define WAZAT_INTEGRAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "types.h"
+#include "featuremap.h"
+
+/* Summed-area table over one 8 bit plane. After build() the sum of any
+ * rectangle costs four lookups, whatever its size.
+ *
+ * Entries are 32 bit and allowed to wrap. Rectangle sums come out right as
+ * long as the true sum of that rectangle fits in 32 bits, which any window
+ * under 16 million samples does. */
+class IntegralImage {
+  // (width + 1) * (height + 1) entries. The first row and column are zero so
+  // queries need no edge cases.
+  struct buffer<uint32_t> table = {0};
+  // One row of samples made contiguous for the SIMD prefix sum, for strides
+  // without a kernel of their own.
+  struct buffer<uint8_t> gathered = {0};
+
+ public:
+  unsigned int width = 0;
+  unsigned int height = 0;
+
+  IntegralImage() {}
+  IntegralImage(const IntegralImage&) = delete;
+  IntegralImage& operator=(const IntegralImage&) = delete;
+  ~IntegralImage() {
+    table.destroy();
+    gathered.destroy();
+  }
+
+  /* Build the table in one pass. Sample (x, y) is read from
+   * samples[x * step + y * stride], so a single channel of an interleaved
+   * RGB24 frame is (start + channel, width, height, width * 3, 3). */
+  void build(const uint8_t* samples,
+             const unsigned int width_,
+             const unsigned int height_,
+             const size_t stride,
+             const unsigned int step = 1);
+
+  /* Build from a feature map, counting set pixels. */
+  void build(const FeatureMap& map);
+
+  /* Sum over columns [x0, x1) and rows [y0, y1). The rectangle is clipped
+   * to the image first. */
+  uint32_t sum(int x0, int y0, int x1, int y1) const {
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > (int)width ? width : x1;
+    y1 = y1 > (int)height ? height : y1;
+    if(x0 >= x1 || y0 >= y1) {
+      return 0;
+    }
+    const size_t rowLength = width + 1;
+    return table.start[x1 + y1 * rowLength] - table.start[x0 + y1 * rowLength] -
+           table.start[x1 + y0 * rowLength] + table.start[x0 + y0 * rowLength];
+  }
+
+  /* Table row y, 0 <= y <= height. Entry x is the sum over columns [0, x)
+   * and rows [0, y). For callers that clip their own windows. */
+  const uint32_t* row(const unsigned int y) const {
+    return table.start + y * (width + 1);
+  }
+
+  /* Sum over the square of side 2 * radius + 1 centred on (x, y). */
+  uint32_t sumAround(const int x, const int y, const int radius) const {
+    return sum(x - radius, y - radius, x + radius + 1, y + radius + 1);
+  }
+};
+
+#endif  // WAZAT_INTEGRAL_H
@@ -120,6 +120,8 @@ void DisplayAsci::enableMenu(int state) {
     menuItems[n_choices] = (ITEM *)NULL;
     menu = new_menu((ITEM **)menuItems);
     set_menu_mark(menu, " * ");
+    // Scroll once there are more entries than fit the window.
+    set_menu_format(menu, 6, 1);
 
     /* Set fore ground and back ground of the menu */
     set_menu_fore(menu, COLOR_PAIR(7) | A_REVERSE);
@@ -137,6 +139,7 @@ void DisplayAsci::enableMenu(int state) {
       menuItemsSub[i][configArray[i]->values.size()] = (ITEM *)NULL;
       menuSub[i] = new_menu((ITEM **)(menuItemsSub[i]));
       set_menu_mark(menuSub[i], " # ");
+      set_menu_format(menuSub[i], 6, 1);
     
       /* Set fore ground and back ground of the menu */
       set_menu_fore(menuSub[i], COLOR_PAIR(7) | A_REVERSE);
@@ -438,6 +441,142 @@ void saveJpeg(void* inputBuffer, size_t inputBufferLength){
   close(jpgfile);
 }
 
+Recorder::Recorder(const char* filename,
+                   unsigned int width,
+                   unsigned int height,
+                   uint32_t pixelFormat,
+                   unsigned int bytesPerLine,
+                   size_t byteBudget,
+                   unsigned int queueDepth) {
+  // One index entry per 4KiB of frames is more than even a blank MJPEG frame
+  // needs.
+  const uint64_t maxFrames = byteBudget / 4096 + 1;
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  const size_t dataOffset =
+    (sizeof(RecordingHeader) + maxFrames * sizeof(RecordingIndex) + pageSize - 1) /
+    pageSize * pageSize;
+  mappingLength = dataOffset + byteBudget;
+
+  if((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0660)) < 0){
+    errno_exit("open");
+  }
+  // Claim the disk space now rather than on the first write to each page.
+  if(posix_fallocate(fd, 0, mappingLength)) {
+    errno_exit("posix_fallocate");
+  }
+  mapping = (uint8_t*)mmap(NULL, mappingLength, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+  if(mapping == MAP_FAILED) {
+    errno_exit("mmap");
+  }
+  madvise(mapping + dataOffset, mappingLength - dataOffset, MADV_SEQUENTIAL);
+
+  header = (RecordingHeader*)mapping;
+  index = (RecordingIndex*)(mapping + sizeof(RecordingHeader));
+  header->magic = RECORDING_MAGIC;
+  header->version = RECORDING_VERSION;
+  header->width = width;
+  header->height = height;
+  header->pixelFormat = pixelFormat;
+  header->bytesPerLine = bytesPerLine;
+  header->dataBytes = byteBudget;
+  header->maxFrames = maxFrames;
+  header->frameCount = 0;
+  header->dataOffset = dataOffset;
+
+  // Slots grow to the largest frame they are given, so raw frames are
+  // allocated here rather than on the caller's thread.
+  slots.resize(std::max(queueDepth, 1u));
+  for(unsigned int i = 0; i < slots.size(); i++) {
+    slots[i].data.resize((size_t)bytesPerLine * height);
+    freeSlots.push_back(i);
+  }
+
+  std::cout << "Recording up to " << (byteBudget >> 20) << "MiB to " << filename << "\n";
+  writerThread = std::thread(&Recorder::writeLoop, this);
+}
+
+Recorder::~Recorder() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    running = false;
+  }
+  changed.notify_all();
+  writerThread.join();
+
+  // Drop the unused tail of the preallocated segment.
+  const size_t used = header->dataOffset + written;
+  std::cout << "Recorded " << header->frameCount << " frames, dropped " << dropped << "\n";
+  msync(mapping, mappingLength, MS_SYNC);
+  munmap(mapping, mappingLength);
+  if(ftruncate(fd, used)) {
+    std::cout << "Could not trim recording" << std::endl;
+  }
+  close(fd);
+}
+
+bool Recorder::record(const uint8_t* data,
+                      size_t length,
+                      const struct timeval& timestamp) {
+  unsigned int slot;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if(freeSlots.empty() || queued >= header->maxFrames ||
+       reserved + length > header->dataBytes) {
+      dropped++;
+      return false;
+    }
+    slot = freeSlots.front();
+    freeSlots.pop_front();
+    queued++;
+    reserved += length;
+  }
+
+  // The slot is ours until it's on the pending queue, so copy unlocked.
+  Pending& frame = slots[slot];
+  if(frame.data.size() < length) {
+    frame.data.resize(length);
+  }
+  frame.length = length;
+  frame.timestampUs = (int64_t)timestamp.tv_sec * 1000000 + timestamp.tv_usec;
+  memcpy(frame.data.data(), data, length);
+
+  std::lock_guard<std::mutex> guard(lock);
+  pending.push_back(slot);
+  changed.notify_all();
+  return true;
+}
+
+void Recorder::writeLoop() {
+  std::unique_lock<std::mutex> guard(lock);
+  while(true) {
+    changed.wait(guard, [this]{ return !running || !pending.empty(); });
+    if(pending.empty()) {
+      // Only get here once running is cleared and everything is written.
+      return;
+    }
+    const unsigned int slot = pending.front();
+    pending.pop_front();
+    guard.unlock();
+
+    // Frames are written in the order record() reserved their space, so
+    // they always fit.
+    const Pending& frame = slots[slot];
+    const uint64_t n = header->frameCount;
+    memcpy(mapping + header->dataOffset + written, frame.data.data(), frame.length);
+    index[n].timestampUs = frame.timestampUs;
+    index[n].offset = written;
+    index[n].length = frame.length;
+    written += frame.length;
+    // Only count the frame once its data and index entry are in place, so a
+    // reader of a partial recording never sees half a frame.
+    __atomic_store_n(&header->frameCount, n + 1, __ATOMIC_RELEASE);
+
+    guard.lock();
+    freeSlots.push_back(slot);
+  }
+}
+
 boolean emptyBuffer(jpeg_compress_struct* cinfo) {
   return TRUE;
 }
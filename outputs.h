@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <vector>
+#include <cstring>
 #include <fcntl.h>    /* For O_RDWR */
 #include <unistd.h>   /* For open(), creat() */
 #include <SDL/SDL.h>
@@ -11,6 +12,12 @@
 #include <curses.h>
 #include <menu.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 #include "config.h"
 #include "types.h"
@@ -79,6 +86,55 @@ class DisplayAsci {
   void prosessSubMenu(int keyPress);
 };
 
+/* Streams raw frames and their capture timestamps into a segment file that
+ * Replay can play back. The file is preallocated for byteBudget bytes of
+ * frames and mapped. record() only copies the frame into one of queueDepth
+ * spare slots; a background thread moves it into the mapping, so the caller
+ * never waits on the disk. */
+class Recorder {
+  int fd;
+  uint8_t* mapping;
+  size_t mappingLength;
+  RecordingHeader* header;
+  RecordingIndex* index;
+
+  struct Pending {
+    std::vector<uint8_t> data;
+    size_t length;
+    int64_t timestampUs;
+  };
+  std::vector<Pending> slots;
+  std::deque<unsigned int> freeSlots;
+  std::deque<unsigned int> pending;
+  std::thread writerThread;
+  std::mutex lock;
+  std::condition_variable changed;
+  bool running = true;
+  uint64_t queued = 0;    // Frames accepted by record().
+  uint64_t reserved = 0;  // Bytes of data those frames take.
+  uint64_t written = 0;   // Bytes of data in the mapping. Writer thread only.
+
+ public:
+  uint64_t dropped = 0;  // Frames refused because the writer was behind or the segment full.
+
+  /* pixelFormat is the PixelFormat the frames will be in and bytesPerLine
+   * their row stride, if they have rows. */
+  Recorder(const char* filename,
+           unsigned int width,
+           unsigned int height,
+           uint32_t pixelFormat,
+           unsigned int bytesPerLine,
+           size_t byteBudget,
+           unsigned int queueDepth = 4);
+  ~Recorder();
+
+  /* Queue a frame for writing. Returns false if it had to be dropped. */
+  bool record(const uint8_t* data, size_t length, const struct timeval& timestamp);
+
+ private:
+  void writeLoop();
+};
+
 void makeJpeg(struct buffer<uint8_t>& inputBuffer,
               struct buffer<uint8_t>& outputBuffer,
               unsigned int width, unsigned int height);
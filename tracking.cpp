@@ -0,0 +1,141 @@
+#include <math.h>
+#include <algorithm>
+
+#include "tracking.h"
+
+/* Bring line.a back into [-90, 90), negating r if it moves by 180 degrees.
+ * Returns true if it did. */
+static bool normalise(struct HoughPeak& line) {
+  if(line.a >= HOUGH_ANGLES / 2) {
+    line.a -= HOUGH_ANGLES;
+  } else if(line.a < -HOUGH_ANGLES / 2) {
+    line.a += HOUGH_ANGLES;
+  } else {
+    return false;
+  }
+  line.r = -line.r;
+  return true;
+}
+
+/* peak written the way nearest to reference, which may take it outside
+ * [-90, 90). */
+static struct HoughPeak nearestForm(const struct HoughPeak& peak,
+                                    const struct HoughPeak& reference) {
+  struct HoughPeak form = peak;
+  if(peak.a - reference.a > HOUGH_ANGLES / 2) {
+    form.a -= HOUGH_ANGLES;
+    form.r = -form.r;
+  } else if(reference.a - peak.a > HOUGH_ANGLES / 2) {
+    form.a += HOUGH_ANGLES;
+    form.r = -form.r;
+  }
+  return form;
+}
+
+void LineTracker::clear() {
+  lines.clear();
+  framesSinceFull = 0;
+  lost = false;
+}
+
+bool LineTracker::update(HoughTransform& hough,
+                         const FeatureMap& features,
+                         std::vector<struct HoughPeak>& peaks,
+                         const unsigned int threshold,
+                         const int neighbourhood,
+                         const size_t maxPeaks,
+                         const int mergeDistance,
+                         const unsigned int cadence,
+                         const double aReach,
+                         const double rReach,
+                         const unsigned int maxMissed,
+                         const unsigned int threads) {
+  predictions.clear();
+  for(const struct TrackedLine& tracked : lines) {
+    struct HoughPeak prediction = tracked.line;
+    prediction.r += tracked.velocityR;
+    prediction.a += tracked.velocityA;
+    predictions.push_back(prediction);
+  }
+
+  const bool full = lines.empty() || lost || ++framesSinceFull >= cadence;
+  if(full) {
+    framesSinceFull = 0;
+    hough.vote(features, threads);
+    hough.findPeaks(found, threshold, neighbourhood, maxPeaks, mergeDistance);
+  } else {
+    // Vote the neighbourhood further out too, so a peak at the edge of a
+    // window is compared with real counts and not with empty cells.
+    hough.voteAround(features, predictions, aReach, rReach, neighbourhood);
+    hough.findPeaksAround(found, threshold, neighbourhood, maxPeaks, mergeDistance);
+  }
+
+  // Strongest peaks choose first, each taking the closest free prediction.
+  matched.assign(lines.size(), false);
+  const size_t existing = lines.size();
+  for(const struct HoughPeak& peak : found) {
+    size_t best = existing;
+    double bestDistance = 2;
+    for(size_t index = 0; index < existing; index++) {
+      if(matched[index]) {
+        continue;
+      }
+      const struct HoughPeak form = nearestForm(peak, predictions[index]);
+      const double da = fabs(form.a - predictions[index].a) / aReach;
+      const double dr = fabs(form.r - predictions[index].r) / rReach;
+      if(da <= 1 && dr <= 1 && da + dr < bestDistance) {
+        best = index;
+        bestDistance = da + dr;
+      }
+    }
+
+    if(best == existing) {
+      lines.push_back({peak, 0, 0, 0, 0});
+      continue;
+    }
+    struct TrackedLine& tracked = lines[best];
+    struct HoughPeak form = nearestForm(peak, tracked.line);
+    tracked.velocityR = (tracked.velocityR + form.r - tracked.line.r) / 2;
+    tracked.velocityA = (tracked.velocityA + form.a - tracked.line.a) / 2;
+    if(normalise(form)) {
+      tracked.velocityR = -tracked.velocityR;
+    }
+    tracked.line = form;
+    tracked.missed = 0;
+    tracked.age++;
+    matched[best] = true;
+  }
+
+  // Lines not found coast on their prediction for a while.
+  size_t missing = 0;
+  size_t kept = 0;
+  for(size_t index = 0; index < lines.size(); index++) {
+    struct TrackedLine tracked = lines[index];
+    if(index < existing && !matched[index]) {
+      missing++;
+      if(++tracked.missed > maxMissed) {
+        continue;
+      }
+      tracked.line = predictions[index];
+      if(normalise(tracked.line)) {
+        tracked.velocityR = -tracked.velocityR;
+      }
+      tracked.age++;
+    }
+    lines[kept++] = tracked;
+  }
+  lines.resize(kept);
+  lost = 2 * missing > existing;
+
+  peaks.clear();
+  for(const struct TrackedLine& tracked : lines) {
+    if(tracked.missed == 0) {
+      peaks.push_back(tracked.line);
+    }
+  }
+  std::sort(peaks.begin(), peaks.end(),
+            [](const struct HoughPeak& lhs, const struct HoughPeak& rhs) {
+    return lhs.votes > rhs.votes;
+  });
+  return full;
+}
@@ -0,0 +1,58 @@
+#ifndef WAZAT_TRACKING_H
+#define WAZAT_TRACKING_H
+
+#include <stddef.h>
+#include <vector>
+
+#include "featuremap.h"
+#include "hough.h"
+
+/* A line followed from frame to frame. */
+struct TrackedLine {
+  struct HoughPeak line;  // Where it was last found, or predicted if missed.
+  double velocityR;       // Smoothed change per frame.
+  double velocityA;
+  unsigned int missed;    // Frames in a row it has not been found.
+  unsigned int age;       // Frames since it was first found.
+};
+
+/* Follows the lines of a HoughTransform across frames with a constant
+ * velocity prediction. Between full transforms a frame only votes round
+ * where the lines held are expected to be, which for a mostly still scene
+ * is a small fraction of the cost of voting every column. */
+class LineTracker {
+  std::vector<struct HoughPeak> predictions;
+  std::vector<struct HoughPeak> found;
+  std::vector<bool> matched;
+  bool lost = false;
+
+ public:
+  std::vector<struct TrackedLine> lines;
+  unsigned int framesSinceFull = 0;
+
+  /* Forget every line, so the next update() runs the full transform. */
+  void clear();
+
+  /* Find this frame's lines with hough and update the tracks. The full
+   * transform runs when no lines are held, every cadence frames, or after a
+   * frame where more than half the lines went missing. Otherwise only the
+   * windows aReach degrees and rReach pixels round each prediction are
+   * voted. A peak continues the nearest unclaimed prediction within reach
+   * and any other peak starts a new line. Lines missing for more than maxMissed frames in
+   * a row are dropped. peaks gets the lines found this frame, strongest
+   * first. Returns true if the full transform ran. */
+  bool update(HoughTransform& hough,
+              const FeatureMap& features,
+              std::vector<struct HoughPeak>& peaks,
+              const unsigned int threshold,
+              const int neighbourhood,
+              const size_t maxPeaks,
+              const int mergeDistance,
+              const unsigned int cadence,
+              const double aReach,
+              const double rReach,
+              const unsigned int maxMissed,
+              const unsigned int threads = 1);
+};
+
+#endif  // WAZAT_TRACKING_H
@@ -2,6 +2,33 @@
 #define WAZAT_TYPES_H
 
 #include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/* Allocate memory that SIMD kernels and the capture driver can both use.
+ * Always at least page aligned, so any cache line or vector alignment holds.
+ * Allocations of a huge page or more are huge page aligned and the kernel is
+ * asked to back them with transparent huge pages. Release with freeAligned(). */
+inline void* allocateAligned(size_t length) {
+  const size_t hugePage = 2 << 20;
+  const size_t alignment = length >= hugePage ? hugePage : 4096;
+  const size_t rounded = (length + alignment - 1) / alignment * alignment;
+
+  void* start = nullptr;
+  if(posix_memalign(&start, alignment, rounded)) {
+    return nullptr;
+  }
+#ifdef MADV_HUGEPAGE
+  if(alignment == hugePage) {
+    madvise(start, rounded, MADV_HUGEPAGE);
+  }
+#endif
+  return start;
+}
+
+inline void freeAligned(void* start) {
+  free(start);
+}
 
 template <class T>
 struct buffer {
@@ -30,6 +57,32 @@ struct buffer {
   }
 };
 
+/* Layout of a raw capture recording: a RecordingHeader, then maxFrames
+ * RecordingIndex entries, then dataBytes of frames packed one after another
+ * from dataOffset. Frames are kept as the driver delivered them, in the
+ * recorded pixelFormat. */
+#define RECORDING_MAGIC 0x57415a52  // "RZAW"
+#define RECORDING_VERSION 2
+
+struct RecordingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t pixelFormat;   // A PixelFormat.
+  uint32_t bytesPerLine;  // Row stride of RGB24 and YUYV frames.
+  uint64_t dataBytes;
+  uint64_t maxFrames;
+  uint64_t frameCount;  // Frames written so far. Bumped after each frame lands.
+  uint64_t dataOffset;
+};
+
+struct RecordingIndex {
+  int64_t timestampUs;  // Capture time.
+  uint64_t offset;      // From dataOffset.
+  uint64_t length;
+};
+
 struct polarCoord {
   int r;
   int16_t a;
@@ -1,6 +1,9 @@
 #include "inputs.h"
 #include "outputs.h"
 #include "filters.h"
+#include "hough.h"
+#include "tracking.h"
+#include "components.h"
 #include "config.h"
 #include "types.h"
 
@@ -8,7 +11,7 @@
  *
  * sudo apt install libjpeg-dev libsdl1.2-dev libsdl-image1.2-dev libv4l-dev
  *
- * g++ -std=c++11 -g -Wall inputs.cpp outputs.cpp filters.cpp config.cpp wazat.cpp -lSDL -lSDL_image -ljpeg -lmenu -lcurses -lv4l2 -O3
+ * g++ -std=c++11 -g -Wall inputs.cpp outputs.cpp convert.cpp integral.cpp filters.cpp hough.cpp tracking.cpp components.cpp config.cpp wazat.cpp -lSDL -lSDL_image -ljpeg -lmenu -lcurses -lv4l2 -pthread -O3
  * */
 
 #define CAMERA
@@ -19,90 +22,198 @@ int main()
   int run = 1;
   struct buffer<uint8_t> inputBuffer = {0};
   struct buffer<uint8_t> outputJpegBuffer = {0};
-  std::vector<uint8_t> featureBuffer;
-  //std::map<struct polarCoord, uint8_t> houghBuffer;
-  struct buffer<uint16_t> houghBuffer = {0};
+  FeatureMap featureBuffer;
+  ComponentMap components;
+  HoughTransform hough;
+  LineTracker tracker;
+  struct buffer<uint8_t> orientationBuffer = {0};
+  std::vector<struct LineSegment> segments;
+  std::vector<struct HoughPeak> peaks;
 
   #ifdef CAMERA
 	const char* deviceName = "/dev/video0";
-  Camera inputDevice(deviceName,
-                     IO_METHOD_MMAP_SINGLE,
-                     (void**)(&(inputBuffer.start)),
-                     &(inputBuffer.length));
+  Camera* camera = new Camera(deviceName,
+                               IO_METHOD_MMAP_RING,
+                               (void**)(&(inputBuffer.start)),
+                               &(inputBuffer.length),
+                               4,
+                               DROP_POLICY_OLDEST,
+                               PIXEL_FORMAT_RGB24);
+  FrameSource* inputDevice = camera;
+  #ifdef RECORD
+  // Frames as the camera sent them, for REPLAY to play back later.
+  camera->startRecording("/tmp/wazat.rec", (size_t)1 << 30);
+  #endif
+  #elif defined(REPLAY)
+  // A recording made with CAMERA and RECORD defined.
+  FrameSource* inputDevice = new Replay("/tmp/wazat.rec", inputBuffer, true, true);
+  #elif defined(SEQUENCE)
+  // A directory of JPEG/PPM images or a .y4m stream.
+  const char* path = "testData/sequence";
+  FrameSource* inputDevice = new Sequence(path, inputBuffer, true);
+  #elif defined(SYNTHETIC)
+  // Generated test scenes with known lines. No camera or test data needed.
+  FrameSource* inputDevice = new Synthetic(inputBuffer, 640, 480);
   #else
   // const char* filename = "testData/im1small.jpg";
   // const char* filename = "testData/CHECKERBOARD.jpg";
   // const char* filename = "testData/310FlbGm2qL.jpg";
   const char* filename = "testData/CountingTriangles.jpg";
-  File inputDevice(filename, inputBuffer);
+  FrameSource* inputDevice = new File(filename, inputBuffer);
   #endif
   
   DisplaySdl displayProcessed(outputJpegBuffer);
   DisplayAsci displayParsed(inputBuffer,
-                            inputDevice.width,
-                            inputDevice.height);
+                            inputDevice->width,
+                            inputDevice->height);
 
   timeout(0);  // Non blocking keyboard read.
   while(run){
-    if(!inputDevice.grabFrame()){
+    if(!inputDevice->grabFrame()){
       break;
     }
     //saveJpeg(inputBuffer, inputBufferLength);
     //run &= displayRaw.update();
     
+    // The still image input can change size when config.fileDecode does.
+    displayParsed.setBuffer(inputBuffer, inputDevice->width, inputDevice->height);
     displayParsed.update(keyPress);
 
-    if(config.blurGaussian.enabled){    
+    if(config.blurGaussian.enabled && config.blurGaussian.values[2].value > 0){
+      const int passes = config.blurGaussian.values[2].value;
+      boxBlur(inputBuffer,
+              inputDevice->width,
+              inputDevice->height,
+              boxRadiusForSigma(config.blurGaussian.values[1].value, passes),
+              passes);
+    } else if(config.blurGaussian.enabled){
       blur(inputBuffer,
-           inputDevice.width,
-           inputDevice.height,
+           inputDevice->width,
+           inputDevice->height,
            config.blurGaussian.values[0].value,
            config.blurGaussian.values[1].value);
     }
+    // Only the plain full transform reads orientations. The other modes
+    // take precedence over it, in the order listed in config.h.
+    const bool oriented = config.hough.enabled && !config.hough.values[3].value &&
+                          !config.lineTracker.enabled &&
+                          config.hough.values[12].value <= 1 &&
+                          config.hough.values[14].value <= 0 &&
+                          config.hough.values[8].value > 0;
     getFeatures(inputBuffer,
                 featureBuffer,
-                inputDevice.width,
-                inputDevice.height,
+                inputDevice->width,
+                inputDevice->height,
                 config.getFeatures.values[0].value,
                 config.getFeatures.values[1].value,
-                config.getFeatures.values[2].value);
+                config.getFeatures.values[2].value,
+                oriented ? &orientationBuffer : nullptr);
     if(config.filterThin.enabled){
       filterThin(featureBuffer,
-                 inputDevice.width,
-                 inputDevice.height,
+                 inputDevice->width,
+                 inputDevice->height,
                  config.filterThin.values[0].value,
                  config.filterThin.values[1].value);
     }
     if(config.filterSmallFeatures.enabled){
-      filterSmallFeatures(featureBuffer, inputDevice.width, inputDevice.height);
+      filterSmallFeatures(featureBuffer, inputDevice->width, inputDevice->height);
+    }
+    if(config.filterComponents.enabled){
+      labelComponents(featureBuffer, components);
+      filterComponents(featureBuffer, components, config.filterComponents.values[0].value);
+    }
+    segments.clear();
+    peaks.clear();
+    if(!config.lineTracker.enabled || !config.hough.enabled || config.hough.values[3].value) {
+      tracker.clear();
     }
     if(config.hough.enabled) {
-      filterHough(featureBuffer, houghBuffer, inputDevice.width, inputDevice.height);
-
-      for(size_t dilateCount = 0; dilateCount < config.hough.values[1].value; dilateCount++) {
-        dilateHough(houghBuffer, inputDevice.width, inputDevice.height);
+      hough.configure(inputDevice->width,
+                      inputDevice->height,
+                      config.hough.values[10].value,
+                      config.hough.values[11].value);
+    }
+    if(config.hough.enabled && config.hough.values[3].value) {
+      hough.findSegmentsProbabilistic(featureBuffer,
+                                      segments,
+                                      config.hough.values[0].value,
+                                      config.hough.values[4].value,
+                                      config.hough.values[5].value,
+                                      config.hough.values[6].value,
+                                      config.hough.values[7].value);
+    } else if(config.hough.enabled) {
+      if(config.lineTracker.enabled) {
+        tracker.update(hough,
+                       featureBuffer,
+                       peaks,
+                       config.hough.values[0].value,
+                       config.hough.values[1].value,
+                       config.hough.values[6].value,
+                       config.hough.values[9].value,
+                       config.lineTracker.values[0].value,
+                       config.lineTracker.values[1].value,
+                       config.lineTracker.values[2].value,
+                       config.lineTracker.values[3].value,
+                       config.hough.values[2].value);
+      } else if(config.hough.values[12].value > 1) {
+        hough.findPeaksCoarseToFine(featureBuffer,
+                                    peaks,
+                                    config.hough.values[12].value,
+                                    config.hough.values[0].value,
+                                    config.hough.values[1].value,
+                                    config.hough.values[6].value,
+                                    config.hough.values[9].value,
+                                    config.hough.values[2].value);
+      } else {
+        if(config.hough.values[14].value > 0) {
+          hough.voteDecayed(featureBuffer,
+                            config.hough.values[14].value,
+                            config.hough.values[15].value,
+                            config.hough.values[2].value);
+        } else if(oriented) {
+          hough.voteOriented(featureBuffer, orientationBuffer, config.hough.values[8].value);
+        } else {
+          hough.vote(featureBuffer, config.hough.values[2].value);
+        }
+        hough.findPeaks(peaks,
+                        config.hough.values[0].value,
+                        config.hough.values[1].value,
+                        config.hough.values[6].value,
+                        config.hough.values[9].value);
+      }
+      if(config.hough.values[13].value) {
+        // Features within half a cell of the line count.
+        extractSegments(featureBuffer,
+                        peaks,
+                        segments,
+                        inputDevice->width,
+                        inputDevice->height,
+                        config.hough.values[4].value,
+                        config.hough.values[5].value,
+                        std::max(1, (int)ceil(hough.rStep / 2)),
+                        hough.angleStep);
       }
-
-      while(erodeHough(houghBuffer,
-            inputDevice.width,
-            inputDevice.height,
-            config.hough.values[0].value));
     }
     memset(inputBuffer.start, 0, inputBuffer.length);
     merge(inputBuffer,
           featureBuffer,
-          inputDevice.width,
-          inputDevice.height);
-    mergeHough(inputBuffer,
-          houghBuffer,
-          inputDevice.width,
-          inputDevice.height,
-          config.hough.values[0].value);
+          inputDevice->width,
+          inputDevice->height);
+    if(!config.hough.values[13].value) {
+      mergeHough(inputBuffer,
+                 peaks,
+                 inputDevice->width,
+                 inputDevice->height);
+    }
+    mergeSegments(inputBuffer,
+                  segments,
+                  inputDevice->width,
+                  inputDevice->height);
 
     makeJpeg(inputBuffer,
              outputJpegBuffer,
-             inputDevice.width,
-             inputDevice.height);
+             inputDevice->width,
+             inputDevice->height);
 
     keyPress = getch();
     run &= displayProcessed.update(keyPress);
@@ -111,10 +222,11 @@ int main()
     }
   }
 
+  delete inputDevice;
   #ifndef CAMERA
   inputBuffer.destroy();
   #endif
   outputJpegBuffer.destroy();
-  houghBuffer.destroy();
+  orientationBuffer.destroy();
   featureBuffer.clear();
 }